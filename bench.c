@@ -0,0 +1,149 @@
+/**
+  * Per job cost of getting a compile command ready and started
+  *
+  *     cc -O2 bench.c -o bench && ./bench [iterations]
+  *
+  * Compares assembling the command string for every job with patching the
+  * paths into the prepared argv template, then spawning through sh -c with
+  * spawning the arguments directly. Every figure is the fastest of several
+  * runs, after a warm-up run.
+  */
+#define KBUILD_H_IMPL
+#include "kbuild.h"
+
+#define BENCH_DEFAULT_ITERATIONS 200000
+#define BENCH_SPAWN_ITERATIONS 200
+#define BENCH_RUNS 5
+#define BENCH_PATHS 4096
+#define BENCH_CFLAGS "-O2 -g -Wall -Wextra -Iinclude -Isrc/common -Ithird_party/zlib -DNDEBUG -DVERSION='\"1.2.3\"' -fno-omit-frame-pointer"
+
+static char bench_input_paths[BENCH_PATHS][64];
+static char bench_output_paths[BENCH_PATHS][64];
+
+static double bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench_spawn(char *const argv[], const char *cmd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (argv != NULL) {
+            execvp(argv[0], argv);
+        } else {
+            execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        }
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+static size_t bench_string_commands(const KbuildFlagSet *flags, int iterations) {
+    size_t checksum = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        char *cmd = kbuild_compile_command(flags, bench_input_paths[i % BENCH_PATHS], bench_output_paths[i % BENCH_PATHS]);
+        checksum += strlen(cmd);
+        free(cmd);
+    }
+
+    return checksum;
+}
+
+static size_t bench_prepared_commands(const KbuildFlagSet *flags, int iterations) {
+    size_t checksum = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        char **job_argv = kbuild_prepare_command(flags, KBUILD_COMMAND_COMPILE, bench_input_paths[i % BENCH_PATHS], bench_output_paths[i % BENCH_PATHS]);
+        if (job_argv == NULL) {
+            fprintf(stderr, "Could not prepare the compile command\n");
+            exit(1);
+        }
+
+        checksum += job_argv[4][0];
+        free(job_argv);
+    }
+
+    return checksum;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+    const KbuildFlagSet *flags = kbuild_intern_flag_set(KBUILD_CC, BENCH_CFLAGS);
+
+    // Made up ahead, so the loops only measure building the commands
+    for (int i = 0; i < BENCH_PATHS; i++) {
+        snprintf(bench_input_paths[i], sizeof(bench_input_paths[i]), "src/module%d/file%d.c", i % 64, i);
+        snprintf(bench_output_paths[i], sizeof(bench_output_paths[i]), "build/src/module%d/file%d.o", i % 64, i);
+    }
+
+    // The warm-up also prepares the template, like the first job of a flag set
+    size_t checksum = bench_string_commands(flags, iterations) + bench_prepared_commands(flags, iterations);
+    double string_seconds = 0;
+    double prepared_seconds = 0;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double start = bench_now();
+        checksum += bench_string_commands(flags, iterations);
+        double seconds = bench_now() - start;
+        if (run == 0 || seconds < string_seconds) {
+            string_seconds = seconds;
+        }
+
+        start = bench_now();
+        checksum += bench_prepared_commands(flags, iterations);
+        seconds = bench_now() - start;
+        if (run == 0 || seconds < prepared_seconds) {
+            prepared_seconds = seconds;
+        }
+    }
+
+    printf("command construction, %d jobs, best of %d runs\n", iterations, BENCH_RUNS);
+    printf("  string assembly  %8.1f ns/job\n", string_seconds / iterations * 1e9);
+    printf("  prepared argv    %8.1f ns/job\n", prepared_seconds / iterations * 1e9);
+
+    // true ignores the compiler arguments, what is left is the cost of starting it
+    char *true_cmd = kbuild_join_separator((const char*[]){ "true", BENCH_CFLAGS }, 2, " ");
+    KBUILD_DYNARR(kbuild_str_t) *true_args = kbuild_split_command(true_cmd);
+    KBUILD_DYNARR_PUSH_BACK(true_args, NULL);
+
+    bench_spawn(NULL, true_cmd);
+    bench_spawn(true_args->buffer, NULL);
+    double shell_seconds = 0;
+    double direct_seconds = 0;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double start = bench_now();
+        for (int i = 0; i < BENCH_SPAWN_ITERATIONS; i++) {
+            bench_spawn(NULL, true_cmd);
+        }
+        double seconds = bench_now() - start;
+        if (run == 0 || seconds < shell_seconds) {
+            shell_seconds = seconds;
+        }
+
+        start = bench_now();
+        for (int i = 0; i < BENCH_SPAWN_ITERATIONS; i++) {
+            bench_spawn(true_args->buffer, NULL);
+        }
+        seconds = bench_now() - start;
+        if (run == 0 || seconds < direct_seconds) {
+            direct_seconds = seconds;
+        }
+    }
+
+    printf("spawn, %d jobs, best of %d runs\n", BENCH_SPAWN_ITERATIONS, BENCH_RUNS);
+    printf("  sh -c            %8.1f us/job\n", shell_seconds / BENCH_SPAWN_ITERATIONS * 1e6);
+    printf("  execvp           %8.1f us/job\n", direct_seconds / BENCH_SPAWN_ITERATIONS * 1e6);
+
+    true_args->len--;
+    kbuild_free_strs(true_args);
+    free(true_cmd);
+    kbuild_config_reset();
+
+    // Keeps the loops from being optimized away
+    return checksum == 0;
+}
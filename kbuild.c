@@ -2,14 +2,49 @@
 #include "kbuild.h"
 
 int main(int argc, char** argv) {
+    // Which headers make the most of the tree recompile when touched
+    if (argc > 1 && strcmp(argv[1], "fanout") == 0) {
+        KbuildFanoutReport *report = kbuild_analyze_fanout("build");
+        kbuild_print_fanout_report(report, 20);
+        kbuild_free_fanout_report(report);
+        return 0;
+    }
+
+    // Dependencies from the files the compilers actually open
+    if (argc > 1 && strcmp(argv[1], "hermetic") == 0) {
+        kbuild_set_hermetic(1);
+    }
+
+    // Sources are preprocessed in a stage of their own, next to the compiles
+    if (argc > 1 && strcmp(argv[1], "pipeline") == 0) {
+        kbuild_set_preprocess_jobs(4);
+    }
+
+    // Compiles go through the executor a remote one would replace
+    KbuildExecutor *executor = NULL;
+    if (argc > 1 && strcmp(argv[1], "remote") == 0) {
+        executor = kbuild_create_local_executor("build/kbuild-cas");
+        kbuild_set_executor(executor);
+    }
+
+    kbuild_set_emit_compile_commands(1);
+
     KBUILD_DYNARR(kbuild_str_t) *object_files = kbuild_compile_files_in_dir("test-src", "build");
-    kbuild_link_files(object_files, "build/saske");
+    if (object_files == NULL) {
+        return KBUILD_ERROR_COMPILING;
+    }
+
+    KbuildError error = kbuild_link_files(object_files, "build/saske");
+
+    kbuild_print_job_summary(10);
+    kbuild_write_job_stats("build/kbuild-stats.json");
 
     for (int i = 0; i < object_files->len; i++) {
         free(object_files->buffer[i]);
     }
 
     KBUILD_FREE_DYNARR(object_files);
+    kbuild_free_executor(executor);
 
-    return 0;
+    return error;
 }
@@ -9,8 +9,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <assert.h>
 
@@ -31,6 +39,39 @@
 #define KBUILD_DIR_MODE 0700
 #define KBUILD_DYNARR_INITIAL_SIZE 32
 #define KBUILD_DYNARR_SCALE_FACTOR 2
+#define KBUILD_HASHMAP_INITIAL_SIZE 16
+#define KBUILD_HASHMAP_SCALE_FACTOR 2
+#define KBUILD_HASHMAP_MAX_LOAD_PERCENT 75
+#define KBUILD_COMPILE_DB_FILE_NAME "compile_commands.json"
+#define KBUILD_COMPILE_DB_TMP_EXTENSION ".tmp"
+#define KBUILD_COMPILE_DB_COPY_CHUNK_SIZE 65536
+#define KBUILD_DEPFILE_EXTENSION ".d"
+#define KBUILD_STAMP_EXTENSION ".kbuild"
+#define KBUILD_LOG_EXTENSION ".log"
+#define KBUILD_TMP_EXTENSION ".kbuild-tmp"
+#define KBUILD_DWO_EXTENSION ".dwo"
+#define KBUILD_DWP_EXTENSION ".dwp"
+#define KBUILD_LTO_CACHE_DIR_NAME "lto-cache"
+#define KBUILD_LTO_CACHE_MAX_SIZE (1024LL * 1024 * 1024)
+#define KBUILD_PREFETCH_WINDOW_FACTOR 2
+#define KBUILD_TRACE_EXTENSION ".trace"
+#define KBUILD_TRACER_NAME "kbuild-tracer"
+#define KBUILD_LOCAL_EXECUTOR_BLOBS_DIR_NAME "blobs"
+#define KBUILD_LOCAL_EXECUTOR_EXEC_DIR_NAME "exec"
+#define KBUILD_LOCAL_EXECUTOR_MAX_SIZE (1024LL * 1024 * 1024)
+#define KBUILD_COPY_CHUNK_SIZE 65536
+#define KBUILD_SHA256_BLOCK_SIZE 64
+#define KBUILD_SHA256_DIGEST_SIZE 32
+#define KBUILD_PREPROCESSED_FILE_NAME "kbuild-preprocessed"
+#define KBUILD_COMMAND_SLOT_MARKER '\x01'
+#define KBUILD_COMMAND_INPUT_SLOT "\x01i"
+#define KBUILD_COMMAND_OUTPUT_SLOT "\x01o"
+#define KBUILD_COMMAND_INPUTS_SLOT "\x01l"
+#define KBUILD_JOB_READ_CHUNK_SIZE 4096
+#define KBUILD_MAX_EPOLL_EVENTS 64
+#define KBUILD_REAP_INTERVAL_MS 10
+#define KBUILD_FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define KBUILD_FNV_PRIME 0x100000001b3ULL
 
 #ifdef PATH_MAX
 #   define KBUILD_PATH_MAX PATH_MAX
@@ -38,30 +79,40 @@
 #   define KBUILD_PATH_MAX 256
 #endif
 
+#define KBUILD_LOG_ERRORF(code, format, ...) \
+    fprintf(stderr, "ERROR[%s, %d] %s " format, __FILE__, __LINE__, kbuild_error_name(code), __VA_ARGS__)
+
 #define KBUILD_ERRORF(code, format, ...) \
     do { \
-        fprintf(stderr, "ERROR[%s, %d] "  #code  " " format, __FILE__, __LINE__, __VA_ARGS__); \
+        KBUILD_LOG_ERRORF(code, format, __VA_ARGS__); \
         exit(code); \
     } while (0)
 
 #define KBUILD_ERROR(code) \
     do { \
-        fprintf(stderr, "ERROR[%s, %d] "  #code "\n", __FILE__, __LINE__); \
+        fprintf(stderr, "ERROR[%s, %d] %s\n", __FILE__, __LINE__, kbuild_error_name(code)); \
         exit(code); \
     } while (0)
 
-#define KBUILD_FOREACH_FILE(dir_path, body) \
+/**
+  * Like KBUILD_FOREACH_FILE, but instead of exiting it stores the error in
+  * error and stops. body can also use break to stop early, the directory is
+  * always closed.
+  */
+#define KBUILD_FOREACH_FILE_OR_ERROR(dir_path, error, body) \
     do { \
         DIR *d; \
         struct dirent *dir; \
-        d = opendir(dir_path); \
-        if (!d) { \
-            KBUILD_ERRORF(KBUILD_ERROR_FILE_NOT_FOUND, "%s\n", dir_path); \
-        } \
         KbuildFileInfo file_info; \
         size_t dir_path_len = strlen(dir_path); \
         if (dir_path_len >= KBUILD_FILE_INFO_FULL_PATH_SIZE) { \
-            KBUILD_ERRORF(KBUILD_ERROR_PATH_TOO_BIG, "%s\n", dir_path); \
+            error = KBUILD_ERROR_PATH_TOO_BIG; \
+            break; \
+        } \
+        d = opendir(dir_path); \
+        if (!d) { \
+            error = KBUILD_ERROR_FILE_NOT_FOUND; \
+            break; \
         } \
         strncpy(file_info.full_path, dir_path, KBUILD_FILE_INFO_FULL_PATH_SIZE); \
         while ((dir = readdir(d)) != NULL) { \
@@ -73,7 +124,8 @@
                 long file_name_len = strlen(file_info.name); \
                 \
                 if ((file_name_len + dir_path_len + 1) >= KBUILD_FILE_INFO_FULL_PATH_SIZE) { \
-                    KBUILD_ERRORF(KBUILD_ERROR_PATH_TOO_BIG, "%s/%s\n", dir_path, file_info.name); \
+                    error = KBUILD_ERROR_PATH_TOO_BIG; \
+                    break; \
                 } \
                 \
                 memcpy(file_info.full_path + dir_path_len + 1,  file_info.name, file_name_len); \
@@ -88,6 +140,15 @@
         closedir(d); \
     } while(0)
 
+#define KBUILD_FOREACH_FILE(dir_path, body) \
+    do { \
+        KbuildError kbuild_foreach_error = KBUILD_OK; \
+        KBUILD_FOREACH_FILE_OR_ERROR(dir_path, kbuild_foreach_error, body); \
+        if (kbuild_foreach_error != KBUILD_OK) { \
+            KBUILD_ERRORF(kbuild_foreach_error, "%s\n", dir_path); \
+        } \
+    } while (0)
+
 #define KBUILD_DYNARR(type) KbuildDynarr_##type
 
 #define KBUILD_DECLARE_DYNARR(type) \
@@ -143,11 +204,231 @@
         }\
     } while (0)
 
+#define KBUILD_HASHMAP(name) KbuildHashmap_##name
+
+/**
+  * Open addressing hash map with linear probing
+  * Hashes, keys and values are kept in three flat arrays, so a lookup only walks
+  * the hashes until it finds a candidate. A stored hash of 0 marks an empty slot.
+  * The map does not own its keys, putting an existing key keeps the stored one.
+  * Lookups return the slot of the entry, or -1.
+  */
+#define KBUILD_DECLARE_HASHMAP(name, key_type, value_type) \
+    typedef struct { \
+        uint64_t *hashes; \
+        key_type *keys; \
+        value_type *values; \
+        int len; \
+        int cap; \
+    } KBUILD_HASHMAP(name); \
+    \
+    KBUILD_HASHMAP(name) *kbuild_create_hashmap_##name(); \
+    void kbuild_free_hashmap_##name(KBUILD_HASHMAP(name) *map); \
+    int kbuild_hashmap_find_##name(const KBUILD_HASHMAP(name) *map, key_type key); \
+    int kbuild_hashmap_put_##name(KBUILD_HASHMAP(name) *map, key_type key, value_type value); \
+    int kbuild_hashmap_remove_##name(KBUILD_HASHMAP(name) *map, key_type key);
+
+#define KBUILD_DEFINE_HASHMAP(name, key_type, value_type, hash_fn, eq_fn) \
+    static uint64_t kbuild_hashmap_hash_##name(key_type key) { \
+        uint64_t hash = hash_fn(key); \
+        return hash == 0 ? 1 : hash; \
+    } \
+    \
+    static void kbuild_hashmap_alloc_##name(KBUILD_HASHMAP(name) *map, int cap) { \
+        map->hashes = calloc(cap, sizeof(uint64_t)); \
+        map->keys = malloc(sizeof(key_type) * cap); \
+        map->values = malloc(sizeof(value_type) * cap); \
+        map->cap = cap; \
+    } \
+    \
+    KBUILD_HASHMAP(name) *kbuild_create_hashmap_##name() { \
+        KBUILD_HASHMAP(name) *map = malloc(sizeof(KBUILD_HASHMAP(name))); \
+        kbuild_hashmap_alloc_##name(map, KBUILD_HASHMAP_INITIAL_SIZE); \
+        map->len = 0; \
+        return map; \
+    } \
+    \
+    void kbuild_free_hashmap_##name(KBUILD_HASHMAP(name) *map) { \
+        assert(map != NULL); \
+        free(map->hashes); \
+        free(map->keys); \
+        free(map->values); \
+        free(map); \
+    } \
+    \
+    static int kbuild_hashmap_probe_##name(const KBUILD_HASHMAP(name) *map, key_type key, uint64_t hash) { \
+        int mask = map->cap - 1; \
+        int i = (int)(hash & mask); \
+        while (map->hashes[i] != 0) { \
+            if (map->hashes[i] == hash && eq_fn(map->keys[i], key)) { \
+                return i; \
+            } \
+            i = (i + 1) & mask; \
+        } \
+        return i; \
+    } \
+    \
+    int kbuild_hashmap_find_##name(const KBUILD_HASHMAP(name) *map, key_type key) { \
+        assert(map != NULL); \
+        int i = kbuild_hashmap_probe_##name(map, key, kbuild_hashmap_hash_##name(key)); \
+        return map->hashes[i] != 0 ? i : -1; \
+    } \
+    \
+    static void kbuild_hashmap_grow_##name(KBUILD_HASHMAP(name) *map) { \
+        uint64_t *old_hashes = map->hashes; \
+        key_type *old_keys = map->keys; \
+        value_type *old_values = map->values; \
+        int old_cap = map->cap; \
+        \
+        kbuild_hashmap_alloc_##name(map, old_cap * KBUILD_HASHMAP_SCALE_FACTOR); \
+        int mask = map->cap - 1; \
+        \
+        for (int j = 0; j < old_cap; j++) { \
+            if (old_hashes[j] == 0) { \
+                continue; \
+            } \
+            int i = (int)(old_hashes[j] & mask); \
+            while (map->hashes[i] != 0) { \
+                i = (i + 1) & mask; \
+            } \
+            map->hashes[i] = old_hashes[j]; \
+            map->keys[i] = old_keys[j]; \
+            map->values[i] = old_values[j]; \
+        } \
+        \
+        free(old_hashes); \
+        free(old_keys); \
+        free(old_values); \
+    } \
+    \
+    int kbuild_hashmap_put_##name(KBUILD_HASHMAP(name) *map, key_type key, value_type value) { \
+        assert(map != NULL); \
+        if ((map->len + 1) * 100 > map->cap * KBUILD_HASHMAP_MAX_LOAD_PERCENT) { \
+            kbuild_hashmap_grow_##name(map); \
+        } \
+        uint64_t hash = kbuild_hashmap_hash_##name(key); \
+        int i = kbuild_hashmap_probe_##name(map, key, hash); \
+        if (map->hashes[i] == 0) { \
+            map->hashes[i] = hash; \
+            map->keys[i] = key; \
+            map->len++; \
+        } \
+        map->values[i] = value; \
+        return i; \
+    } \
+    \
+    int kbuild_hashmap_remove_##name(KBUILD_HASHMAP(name) *map, key_type key) { \
+        int hole = kbuild_hashmap_find_##name(map, key); \
+        if (hole < 0) { \
+            return 0; \
+        } \
+        /* Backward shift instead of tombstones: an entry moves into the hole \
+           unless its home slot lies between the hole and itself */ \
+        int mask = map->cap - 1; \
+        for (int j = (hole + 1) & mask; map->hashes[j] != 0; j = (j + 1) & mask) { \
+            int home = (int)(map->hashes[j] & mask); \
+            if (((j - home) & mask) >= ((j - hole) & mask)) { \
+                map->hashes[hole] = map->hashes[j]; \
+                map->keys[hole] = map->keys[j]; \
+                map->values[hole] = map->values[j]; \
+                hole = j; \
+            } \
+        } \
+        map->hashes[hole] = 0; \
+        map->len--; \
+        return 1; \
+    }
+
+#define KBUILD_CREATE_HASHMAP(name) kbuild_create_hashmap_##name()
+#define KBUILD_FREE_HASHMAP(name, map) kbuild_free_hashmap_##name(map)
+#define KBUILD_HASHMAP_FIND(name, map, key) kbuild_hashmap_find_##name(map, key)
+#define KBUILD_HASHMAP_PUT(name, map, key, value) kbuild_hashmap_put_##name(map, key, value)
+#define KBUILD_HASHMAP_REMOVE(name, map, key) kbuild_hashmap_remove_##name(map, key)
+#define KBUILD_HASHMAP_SLOT_USED(map, slot) ((map)->hashes[slot] != 0)
+
+/**
+  * A hash set is a hash map without values
+  */
+#define KBUILD_HASHSET(name) KBUILD_HASHMAP(name)
+#define KBUILD_DECLARE_HASHSET(name, key_type) KBUILD_DECLARE_HASHMAP(name, key_type, char)
+#define KBUILD_DEFINE_HASHSET(name, key_type, hash_fn, eq_fn) KBUILD_DEFINE_HASHMAP(name, key_type, char, hash_fn, eq_fn)
+#define KBUILD_CREATE_HASHSET(name) KBUILD_CREATE_HASHMAP(name)
+#define KBUILD_FREE_HASHSET(name, set) KBUILD_FREE_HASHMAP(name, set)
+#define KBUILD_HASHSET_ADD(name, set, key) kbuild_hashmap_put_##name(set, key, 0)
+#define KBUILD_HASHSET_CONTAINS(name, set, key) (kbuild_hashmap_find_##name(set, key) >= 0)
+#define KBUILD_HASHSET_REMOVE(name, set, key) kbuild_hashmap_remove_##name(set, key)
+
 typedef char* kbuild_str_t;
 
 KBUILD_DECLARE_DYNARR(int);
 KBUILD_DECLARE_DYNARR(kbuild_str_t);
 
+KBUILD_DECLARE_HASHMAP(kbuild_str_to_int, const char*, int);
+
+/**
+  * Gives every unique string a stable small id, counting from 0
+  * The table owns a copy of each string, ids index into strs.
+  */
+typedef struct {
+    KBUILD_HASHMAP(kbuild_str_to_int) *ids;
+    KBUILD_DYNARR(kbuild_str_t) *strs;
+} KbuildInternTable;
+
+/**
+  * Compiler configuration for a directory or a single file
+  *
+  * A file is compiled with every config whose path is one of its parent
+  * directories or the file itself, applied from the outermost to the innermost.
+  * Flags, include paths and defines are accumulated, the innermost compiler wins.
+  */
+typedef struct {
+    char *path;
+    char *cc;
+    KBUILD_DYNARR(kbuild_str_t) *cflags;
+    KBUILD_DYNARR(kbuild_str_t) *include_paths;
+    KBUILD_DYNARR(kbuild_str_t) *defines;
+    KBUILD_DYNARR(kbuild_str_t) *ldflags;
+} KbuildConfig;
+
+typedef enum {
+    KBUILD_COMMAND_COMPILE = 0,
+    KBUILD_COMMAND_PREPROCESS = 1,
+    KBUILD_COMMAND_COMPILE_PREPROCESSED = 2,
+    KBUILD_COMMAND_COMPILE_PREPROCESSED_CXX = 3,
+    KBUILD_COMMAND_KIND_COUNT = 4
+} KbuildCommandKind;
+
+/**
+  * A command split into arguments once, to be run without a shell
+  * An argument starting with KBUILD_COMMAND_SLOT_MARKER is a slot, the next
+  * character picks the input (i) or output (o) path of the job and the rest
+  * is appended to it, or the list of inputs (l) with one argument for each.
+  * args is NULL when the command needs a shell.
+  */
+typedef struct {
+    KBUILD_DYNARR(kbuild_str_t) *args;
+    int slot_count;
+} KbuildCommandTemplate;
+
+/**
+  * A resolved and interned compiler + flags combination
+  *
+  * There is only ever one KbuildFlagSet for a given combination, so two files
+  * are compiled the same way if and only if they have the same id. The
+  * command templates are prepared on first use, a second set of them for the
+  * hermetic mode.
+  */
+typedef struct {
+    uint64_t id;
+    char *cc;
+    char *cflags;
+    KbuildCommandTemplate *templates[KBUILD_COMMAND_KIND_COUNT * 2];
+} KbuildFlagSet;
+
+typedef KbuildConfig* kbuild_config_ptr_t;
+
+KBUILD_DECLARE_DYNARR(kbuild_config_ptr_t);
+
 typedef struct {
     const char *name;
     char full_path[KBUILD_FILE_INFO_FULL_PATH_SIZE];
@@ -155,6 +436,7 @@ typedef struct {
 } KbuildFileInfo;
 
 typedef enum {
+    KBUILD_OK = 0,
     KBUILD_ERROR_FILE_NOT_FOUND = 1,
     KBUILD_ERROR_PATH_TOO_BIG = 2,
     KBUILD_ERROR_COMPILING = 3,
@@ -162,9 +444,16 @@ typedef enum {
     KBUILD_ERROR_EXTENSION_SIZE_TOO_BIG = 5,
     KBUILD_ERROR_INVALID_EXTENSION = 6,
     KBUILDER_ERROR_INVALID_PATH = 7,
-    KBUILD_ERROR_LINKING = 8
+    KBUILD_ERROR_LINKING = 8,
+    KBUILD_ERROR_COMPILE_DB = 9,
+    KBUILD_ERROR_SPAWNING = 10,
+    KBUILD_ERROR_INTERRUPTED = 11,
+    KBUILD_ERROR_WRITING_FILE = 12,
+    KBUILD_ERROR_EXECUTOR = 13
 } KbuildError;
 
+const char *kbuild_error_name(KbuildError error);
+
 typedef struct {
     char *dirname;
     char *extension;
@@ -178,17 +467,398 @@ typedef struct {
     int cap;
 } KbuildStringBuilder;
 
+/**
+  * Streaming writer for compile_commands.json
+  *
+  * Every entry is rendered on its own and written straight to disk, the whole
+  * database is never held in memory. While the new entries match the ones
+  * already on disk nothing is written at all, at the first difference the
+  * matching prefix is copied into a temporary file and the rest is streamed
+  * after it, which is then renamed over the old database.
+  */
+typedef struct {
+    char *path;
+    char *tmp_path;
+    char *directory;
+    FILE *previous;
+    FILE *file;
+    long matched_bytes;
+    int entries;
+    int failed;
+    KbuildStringBuilder *entry;
+} KbuildCompileDb;
+
+/**
+  * A command with the files it reads and writes, as a remote worker needs it
+  * Relative paths travel with the command, absolute ones (the toolchain,
+  * system headers) have to exist wherever it runs. env holds NAME=value
+  * strings set for the command only. fd and data are set by the executor.
+  */
+typedef struct {
+    char *command;
+    KBUILD_DYNARR(kbuild_str_t) *inputs;
+    KBUILD_DYNARR(kbuild_str_t) *outputs;
+    KBUILD_DYNARR(kbuild_str_t) *env;
+    int fd;
+    void *data;
+    struct KbuildExecutor *executor;
+} KbuildAction;
+
+/**
+  * Where compiles run instead of the current process
+  * submit takes the command of an action with its inputs and starts it,
+  * setting fd to a descriptor that becomes readable once the action finished.
+  * The scheduler polls it next to its own jobs, then collect gets the exit
+  * status, the resources used and the output of the command, brings the
+  * outputs back into place and releases what submit set up. cancel asks a
+  * submitted action to stop, it is collected like any other afterwards.
+  */
+typedef struct KbuildExecutor {
+    KbuildError (*submit)(struct KbuildExecutor *executor, KbuildAction *action);
+    KbuildError (*collect)(struct KbuildExecutor *executor, KbuildAction *action, int *status, struct rusage *usage, KbuildStringBuilder *output);
+    void (*cancel)(struct KbuildExecutor *executor, KbuildAction *action);
+    void (*free)(struct KbuildExecutor *executor);
+    void *data;
+} KbuildExecutor;
+
+/**
+  * A spawned command, its stdout and stderr go to a single pipe and are
+  * buffered in output until the job finishes
+  */
+typedef struct {
+    pid_t pid;
+    int output_fd;
+    int sequence;
+    int status;
+    int finished;
+    int cancelled;
+    KbuildError error_code;
+    KbuildStringBuilder *output;
+    char *description;
+    char *output_path;
+    const KbuildFlagSet *flags;
+    const char *timing_label;
+    struct timespec started;
+    double elapsed;
+    struct rusage usage;
+    char *trace_path;
+    KbuildAction *action;
+    char **argv;
+    char *compile_command;
+    char **compile_argv;
+    int preprocessed_fd;
+    int preprocessing;
+    int pid_fd;
+} KbuildJob;
+
+typedef KbuildJob* kbuild_job_ptr_t;
+
+KBUILD_DECLARE_DYNARR(kbuild_job_ptr_t);
+
+/**
+  * Resources used by a finished job and every process it waited for
+  */
+typedef struct {
+    char *description;
+    const char *kind;
+    int status;
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    long max_rss_kb;
+    long in_blocks;
+    long out_blocks;
+} KbuildJobStats;
+
+typedef KbuildJobStats* kbuild_job_stats_ptr_t;
+
+KBUILD_DECLARE_DYNARR(kbuild_job_stats_ptr_t);
+
+typedef struct {
+    int epoll_fd;
+    int max_jobs;
+    int ordered_output;
+    int keep_going;
+    int running;
+    int next_sequence;
+    int next_flush;
+    KbuildError error;
+    KBUILD_DYNARR(kbuild_job_ptr_t) *jobs;
+    KBUILD_DYNARR(kbuild_str_t) *failures;
+    int max_preprocess_jobs;
+    int running_preprocess;
+    KBUILD_DYNARR(kbuild_job_ptr_t) *ready;
+    KBUILD_DYNARR(kbuild_job_ptr_t) *exiting;
+    int interrupted;
+} KbuildScheduler;
+
 int kbuild_is_dir(const char* path);
+
+/**
+  * Creates path and its missing parents
+  * The directories created or found are remembered, so asking again for them
+  * or one of their parents does not touch the filesystem.
+  */
 int kbuild_mkdir(const char* path);
 
+/**
+  * Forgets the directories remembered by kbuild_mkdir, needed when they are
+  * removed behind its back
+  */
+void kbuild_reset_dir_cache();
+
+uint64_t kbuild_hash_bytes(const void *data, size_t len);
+uint64_t kbuild_hash_string(const char *str);
+
+KbuildInternTable *kbuild_create_intern_table();
+void kbuild_free_intern_table(KbuildInternTable *table);
+
+/**
+  * Returns the id of str, adding it to the table if needed
+  */
+int kbuild_intern(KbuildInternTable *table, const char *str);
+
+/**
+  * Like kbuild_intern, but "a//b/./c/" and "a/b/c" get the same id
+  */
+int kbuild_intern_path(KbuildInternTable *table, const char *path);
+
+/**
+  * Returns the id of str, or -1 if it was never interned
+  */
+int kbuild_intern_find(const KbuildInternTable *table, const char *str);
+const char *kbuild_interned_string(const KbuildInternTable *table, int id);
+
+/**
+  * Returns the config for a directory or file, creating it if needed
+  * An empty path (or NULL) is the global config, which applies to every file
+  */
+KbuildConfig *kbuild_config(const char *path);
+void kbuild_config_set_cc(KbuildConfig *config, const char *cc);
+void kbuild_config_add_cflags(KbuildConfig *config, const char *cflags);
+void kbuild_config_add_include_path(KbuildConfig *config, const char *include_path);
+void kbuild_config_add_define(KbuildConfig *config, const char *define);
+
+/**
+  * Linker flags are only read from the global config
+  */
+void kbuild_config_add_ldflags(KbuildConfig *config, const char *ldflags);
+
+/**
+  * Frees every config and interned flag set
+  */
+void kbuild_config_reset();
+
+/**
+  * Returns the interned flag set for the given compiler and flags
+  * The returned pointer is owned by kbuild and stays valid until kbuild_config_reset
+  */
+const KbuildFlagSet *kbuild_intern_flag_set(const char *cc, const char *cflags);
+
+/**
+  * Returns the flag set used to compile the file at path
+  */
+const KbuildFlagSet *kbuild_resolve_flags(const char *path);
+
+/**
+  * Splits cmd into arguments the way sh would, or returns NULL when it uses
+  * anything beyond quoting (expansions, globs, redirections, pipes)
+  */
+KBUILD_DYNARR(kbuild_str_t) *kbuild_split_command(const char *cmd);
+
+/**
+  * Returns the arguments of the command of kind for one job, from the template
+  * of flags with the input and output paths patched in, or NULL when the flags
+  * need a shell. The array and its strings are a single allocation, freed with
+  * free.
+  */
+char **kbuild_prepare_command(const KbuildFlagSet *flags, KbuildCommandKind kind, const char *input_path, const char *output_path);
+
+/**
+  * Parses a make style dependency file (as written by -MMD)
+  * Returns the prerequisites, or NULL if the file could not be read
+  */
+KBUILD_DYNARR(kbuild_str_t) *kbuild_parse_depfile(const char *path);
+
+/**
+  * Checks if output_path has to be rebuilt from input_path: it is missing,
+  * older than the source or one of its dependencies, or was compiled with a
+  * different flag set
+  */
+int kbuild_needs_compile(const char *input_path, const char *output_path, const KbuildFlagSet *flags);
+
 char *kbuild_join_paths(const char** paths, int paths_len);
 char *kbuild_join(const char** strs, int strs_len);
 char *kbuild_join_separator(const char** strs, int strs_len, const char *ch);
 
 
-void kbuild_compile(const char* input_path, const char*output_path);
+KbuildCompileDb *kbuild_compile_db_open(const char *build_path);
+void kbuild_compile_db_add(KbuildCompileDb *db, const char *command, const char *input_path, const char *output_path);
+KbuildError kbuild_compile_db_close(KbuildCompileDb *db);
+
+/**
+  * When enabled, kbuild_compile_files_in_dir writes compile_commands.json
+  * into the build directory for the files it finds
+  */
+void kbuild_set_emit_compile_commands(int enabled);
+
+/**
+  * Maximum number of jobs running at the same time, the number of online CPUs by default
+  */
+void kbuild_set_jobs(int max_jobs);
+
+/**
+  * When enabled, the output of the jobs is shown in the order they were
+  * submitted instead of the order they finish
+  */
+void kbuild_set_ordered_output(int enabled);
+
+/**
+  * By default the first failing job stops the build: the running jobs are
+  * terminated and their partial outputs removed. With keep going enabled
+  * every job still runs and all the failures are reported at the end.
+  */
+void kbuild_set_keep_going(int enabled);
+
+/**
+  * Splits every compile into a preprocessing stage, at most max_jobs at a
+  * time, feeding the compile stage through an in-memory file. The compile
+  * stage keeps the kbuild_set_jobs limit, so sources are read from disk
+  * while all the cores compile. 0, the default, compiles in a single step.
+  */
+void kbuild_set_preprocess_jobs(int max_jobs);
+
+/**
+  * Linker passed to the compiler driver with -fuse-ld
+  * By default (NULL) the first of mold, lld and gold the driver accepts is
+  * used, an empty string keeps the driver's default linker.
+  */
+void kbuild_set_linker(const char *linker);
+
+/**
+  * When enabled, objects are compiled with -gsplit-dwarf and the .dwo files
+  * are packaged into <output>.dwp next to the linked file, while it is linked
+  */
+void kbuild_set_split_dwarf(int enabled);
+
+/**
+  * When enabled, objects and links use ThinLTO (-flto=thin) with clang or
+  * -flto with gcc, and the link time optimization runs on as many threads as
+  * there are jobs. The ThinLTO cache lives in lto-cache next to the linked
+  * file, so after an edit only the affected modules are optimized again.
+  */
+void kbuild_set_lto(int enabled);
+
+/**
+  * Size the ThinLTO cache is pruned to after every link, least recently used
+  * files first. GCC manages its incremental LTO cache itself.
+  */
+void kbuild_set_lto_cache_size(long long max_bytes);
+
+/**
+  * Removes the least recently modified files in dir_path until the files left
+  * take at most max_bytes
+  */
+void kbuild_prune_dir(const char *dir_path, long long max_bytes);
+
+/**
+  * When enabled, compiles run with a file access tracer preloaded, which
+  * records every file the compiler and the processes it spawns open. The
+  * files read become the dependencies of the object instead of -MMD, and a
+  * file of the project read from outside the source directory and the
+  * include paths is reported as an undeclared input.
+  */
+void kbuild_set_hermetic(int enabled);
+
+/**
+  * Routes every compile through executor, NULL runs them in place again
+  * The executor stays owned by the caller, see kbuild_free_executor.
+  */
+void kbuild_set_executor(KbuildExecutor *executor);
+
+/**
+  * Executor that works like a remote one on this machine: inputs are uploaded
+  * by content into root_path/blobs, every action runs in its own directory
+  * under root_path/exec holding only its inputs, and the outputs are stored
+  * as blobs before being downloaded into place.
+  */
+KbuildExecutor *kbuild_create_local_executor(const char *root_path);
+void kbuild_free_executor(KbuildExecutor *executor);
+
+/**
+  * Returns the full path of an executable found on PATH, or NULL
+  * The returned pointer should be freed by the caller
+  */
+char *kbuild_find_program(const char *name);
+
+/**
+  * Waits for every running job to finish
+  * Returns the error of the first job that failed, if any
+  */
+KbuildError kbuild_wait_jobs();
+
+/**
+  * Sends SIGTERM to every running job, their outputs are removed once they exit
+  */
+void kbuild_cancel_jobs();
+
+/**
+  * Returns the stats of every job finished since the start or the last reset
+  * The array is owned by kbuild
+  */
+const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *kbuild_job_stats();
+void kbuild_reset_job_stats();
+
+/**
+  * Prints the top_n jobs that used the most CPU time, with their peak RSS
+  * and block I/O, followed by the totals
+  */
+void kbuild_print_job_summary(int top_n);
+
+/**
+  * Writes the stats of every job to path, as JSON if it ends in .json and
+  * as CSV otherwise
+  */
+KbuildError kbuild_write_job_stats(const char *path);
+
+KbuildError kbuild_compile(const char* input_path, const char*output_path);
+
+/**
+  * Returns the object files, or NULL if something could not be compiled
+  */
 KBUILD_DYNARR(kbuild_str_t) *kbuild_compile_files_in_dir(const char* path, const char *build_path);
-void kbuild_link_files(KBUILD_DYNARR(kbuild_str_t) *object_files, const char *output_file_path);
+KbuildError kbuild_link_files(KBUILD_DYNARR(kbuild_str_t) *object_files, const char *output_file_path);
+
+/**
+  * How much of the build an edit to each header sets off, from the depfiles
+  * and stamps of the objects in a build directory
+  * Ids of the headers table index dependents and cost_seconds, ranked lists
+  * them from the most to the least expensive to touch.
+  */
+typedef struct {
+    KbuildInternTable *headers;
+    int *dependents;
+    double *cost_seconds;
+    int *ranked;
+    int translation_units;
+    double total_cost_seconds;
+} KbuildFanoutReport;
+
+/**
+  * Builds the report for every object under build_path
+  * The cost of a header is the recorded CPU time of the objects including it,
+  * objects compiled before the times were recorded only add to dependents.
+  */
+KbuildFanoutReport *kbuild_analyze_fanout(const char *build_path);
+void kbuild_print_fanout_report(const KbuildFanoutReport *report, int top_n);
+void kbuild_free_fanout_report(KbuildFanoutReport *report);
+
+/**
+  * Removes the temporary outputs an interrupted build left in build_path
+  * Jobs write to a temporary file next to their output, which is only renamed
+  * into place once the job succeeds.
+  */
+void kbuild_sweep_tmp_files(const char *build_path);
 
 KbuildPathInfo *kbuild_pathinfo(const char* path);
 void kbuild_free_pathinfo(KbuildPathInfo  *pathinfo);
@@ -198,6 +868,11 @@ void kbuild_string_builder_append(KbuildStringBuilder * builder, const char* str
 void kbuild_string_builder_appendn(KbuildStringBuilder * builder, const char* str, int n);
 void kbuild_string_builder_append_ch(KbuildStringBuilder * builder, char ch);
 
+/**
+  * Appends str as a quoted and escaped JSON string
+  */
+void kbuild_string_builder_append_json(KbuildStringBuilder * builder, const char* str);
+
 /**
   * Builds a char* from the internal buffer
   * The returned pointer should be freed by the caller
@@ -218,8 +893,197 @@ void kbuild_free_string_builder(KbuildStringBuilder *string_buider);
 
 #ifdef KBUILD_H_IMPL
 
+/**
+  * Source of the LD_PRELOAD library used by the hermetic mode
+  * It wraps the libc open functions and appends "r <path>" or "w <path>" to
+  * $KBUILD_TRACE_FILE for every file opened successfully. Being inherited
+  * through the environment, it also traces the processes the driver spawns.
+  */
+#define KBUILD_TRACER_SOURCE \
+    "#define _GNU_SOURCE\n" \
+    "#include <dlfcn.h>\n" \
+    "#include <fcntl.h>\n" \
+    "#include <stdarg.h>\n" \
+    "#include <stdio.h>\n" \
+    "#include <stdlib.h>\n" \
+    "#include <string.h>\n" \
+    "#include <unistd.h>\n" \
+    "\n" \
+    "static void kbuild_trace(int dirfd, const char *path, int flags) {\n" \
+    "    static int (*real_open)(const char *, int, ...);\n" \
+    "    const char *trace_path = getenv(\"KBUILD_TRACE_FILE\");\n" \
+    "    if (trace_path == NULL || path == NULL) {\n" \
+    "        return;\n" \
+    "    }\n" \
+    "    if (real_open == NULL) {\n" \
+    "        real_open = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, \"open\");\n" \
+    "    }\n" \
+    "    char mode = (flags & O_ACCMODE) == O_RDONLY ? 'r' : 'w';\n" \
+    "    char line[8192];\n" \
+    "    int len;\n" \
+    "    if (path[0] != '/' && dirfd != AT_FDCWD) {\n" \
+    "        char fd_path[64];\n" \
+    "        char dir[4096];\n" \
+    "        snprintf(fd_path, sizeof(fd_path), \"/proc/self/fd/%d\", dirfd);\n" \
+    "        ssize_t dir_len = readlink(fd_path, dir, sizeof(dir) - 1);\n" \
+    "        if (dir_len < 0) {\n" \
+    "            return;\n" \
+    "        }\n" \
+    "        dir[dir_len] = '\\0';\n" \
+    "        len = snprintf(line, sizeof(line), \"%c %s/%s\\n\", mode, dir, path);\n" \
+    "    } else {\n" \
+    "        len = snprintf(line, sizeof(line), \"%c %s\\n\", mode, path);\n" \
+    "    }\n" \
+    "    if (len <= 0 || len >= (int)sizeof(line)) {\n" \
+    "        return;\n" \
+    "    }\n" \
+    "    int fd = real_open(trace_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);\n" \
+    "    if (fd >= 0) {\n" \
+    "        ssize_t written = write(fd, line, len);\n" \
+    "        (void)written;\n" \
+    "        close(fd);\n" \
+    "    }\n" \
+    "}\n" \
+    "\n" \
+    "#define KBUILD_TRACE_MODE(flags) \\\n" \
+    "    int mode = 0; \\\n" \
+    "    if ((flags) & (O_CREAT | O_TMPFILE)) { \\\n" \
+    "        va_list args; \\\n" \
+    "        va_start(args, flags); \\\n" \
+    "        mode = va_arg(args, int); \\\n" \
+    "        va_end(args); \\\n" \
+    "    }\n" \
+    "\n" \
+    "#define KBUILD_TRACE_OPEN(name) \\\n" \
+    "    int name(const char *path, int flags, ...) { \\\n" \
+    "        static int (*real)(const char *, int, ...); \\\n" \
+    "        if (real == NULL) { \\\n" \
+    "            real = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, #name); \\\n" \
+    "        } \\\n" \
+    "        KBUILD_TRACE_MODE(flags) \\\n" \
+    "        int fd = real(path, flags, mode); \\\n" \
+    "        if (fd >= 0) { \\\n" \
+    "            kbuild_trace(AT_FDCWD, path, flags); \\\n" \
+    "        } \\\n" \
+    "        return fd; \\\n" \
+    "    }\n" \
+    "\n" \
+    "#define KBUILD_TRACE_OPENAT(name) \\\n" \
+    "    int name(int dirfd, const char *path, int flags, ...) { \\\n" \
+    "        static int (*real)(int, const char *, int, ...); \\\n" \
+    "        if (real == NULL) { \\\n" \
+    "            real = (int (*)(int, const char *, int, ...))dlsym(RTLD_NEXT, #name); \\\n" \
+    "        } \\\n" \
+    "        KBUILD_TRACE_MODE(flags) \\\n" \
+    "        int fd = real(dirfd, path, flags, mode); \\\n" \
+    "        if (fd >= 0) { \\\n" \
+    "            kbuild_trace(dirfd, path, flags); \\\n" \
+    "        } \\\n" \
+    "        return fd; \\\n" \
+    "    }\n" \
+    "\n" \
+    "#define KBUILD_TRACE_OPEN_2(name) \\\n" \
+    "    int name(const char *path, int flags) { \\\n" \
+    "        static int (*real)(const char *, int); \\\n" \
+    "        if (real == NULL) { \\\n" \
+    "            real = (int (*)(const char *, int))dlsym(RTLD_NEXT, #name); \\\n" \
+    "        } \\\n" \
+    "        int fd = real(path, flags); \\\n" \
+    "        if (fd >= 0) { \\\n" \
+    "            kbuild_trace(AT_FDCWD, path, flags); \\\n" \
+    "        } \\\n" \
+    "        return fd; \\\n" \
+    "    }\n" \
+    "\n" \
+    "#define KBUILD_TRACE_OPENAT_2(name) \\\n" \
+    "    int name(int dirfd, const char *path, int flags) { \\\n" \
+    "        static int (*real)(int, const char *, int); \\\n" \
+    "        if (real == NULL) { \\\n" \
+    "            real = (int (*)(int, const char *, int))dlsym(RTLD_NEXT, #name); \\\n" \
+    "        } \\\n" \
+    "        int fd = real(dirfd, path, flags); \\\n" \
+    "        if (fd >= 0) { \\\n" \
+    "            kbuild_trace(dirfd, path, flags); \\\n" \
+    "        } \\\n" \
+    "        return fd; \\\n" \
+    "    }\n" \
+    "\n" \
+    "#define KBUILD_TRACE_FOPEN(name) \\\n" \
+    "    FILE *name(const char *path, const char *mode) { \\\n" \
+    "        static FILE *(*real)(const char *, const char *); \\\n" \
+    "        if (real == NULL) { \\\n" \
+    "            real = (FILE *(*)(const char *, const char *))dlsym(RTLD_NEXT, #name); \\\n" \
+    "        } \\\n" \
+    "        FILE *file = real(path, mode); \\\n" \
+    "        if (file != NULL) { \\\n" \
+    "            kbuild_trace(AT_FDCWD, path, mode[0] == 'r' && strchr(mode, '+') == NULL ? O_RDONLY : O_WRONLY); \\\n" \
+    "        } \\\n" \
+    "        return file; \\\n" \
+    "    }\n" \
+    "\n" \
+    "KBUILD_TRACE_OPEN(open)\n" \
+    "KBUILD_TRACE_OPEN(open64)\n" \
+    "KBUILD_TRACE_OPENAT(openat)\n" \
+    "KBUILD_TRACE_OPENAT(openat64)\n" \
+    "KBUILD_TRACE_OPEN_2(__open_2)\n" \
+    "KBUILD_TRACE_OPEN_2(__open64_2)\n" \
+    "KBUILD_TRACE_OPENAT_2(__openat_2)\n" \
+    "KBUILD_TRACE_OPENAT_2(__openat64_2)\n" \
+    "KBUILD_TRACE_FOPEN(fopen)\n" \
+    "KBUILD_TRACE_FOPEN(fopen64)\n"
+
 KBUILD_DEFINE_DYNARR(int);
 KBUILD_DEFINE_DYNARR(kbuild_str_t);
+KBUILD_DEFINE_DYNARR(kbuild_config_ptr_t);
+KBUILD_DEFINE_DYNARR(kbuild_job_ptr_t);
+KBUILD_DEFINE_DYNARR(kbuild_job_stats_ptr_t);
+
+static int kbuild_str_eq(const char *a, const char *b) {
+    return strcmp(a, b) == 0;
+}
+
+static uint64_t kbuild_flag_set_hash(const KbuildFlagSet *flag_set) {
+    return flag_set->id;
+}
+
+static int kbuild_flag_set_eq(const KbuildFlagSet *a, const KbuildFlagSet *b) {
+    return a->id == b->id && strcmp(a->cc, b->cc) == 0 && strcmp(a->cflags, b->cflags) == 0;
+}
+
+KBUILD_DEFINE_HASHMAP(kbuild_str_to_int, const char*, int, kbuild_hash_string, kbuild_str_eq);
+
+KBUILD_DECLARE_HASHMAP(kbuild_str_to_config, const char*, kbuild_config_ptr_t);
+KBUILD_DEFINE_HASHMAP(kbuild_str_to_config, const char*, kbuild_config_ptr_t, kbuild_hash_string, kbuild_str_eq);
+
+KBUILD_DECLARE_HASHSET(kbuild_str_set, const char*);
+KBUILD_DEFINE_HASHSET(kbuild_str_set, const char*, kbuild_hash_string, kbuild_str_eq);
+
+KBUILD_DECLARE_HASHSET(kbuild_flag_set_table, const KbuildFlagSet*);
+KBUILD_DEFINE_HASHSET(kbuild_flag_set_table, const KbuildFlagSet*, kbuild_flag_set_hash, kbuild_flag_set_eq);
+
+KBUILD_DECLARE_HASHMAP(kbuild_str_to_flag_set, const char*, const KbuildFlagSet*);
+KBUILD_DEFINE_HASHMAP(kbuild_str_to_flag_set, const char*, const KbuildFlagSet*, kbuild_hash_string, kbuild_str_eq);
+
+const char *kbuild_error_name(KbuildError error) {
+    switch (error) {
+        case KBUILD_OK: return "KBUILD_OK";
+        case KBUILD_ERROR_FILE_NOT_FOUND: return "KBUILD_ERROR_FILE_NOT_FOUND";
+        case KBUILD_ERROR_PATH_TOO_BIG: return "KBUILD_ERROR_PATH_TOO_BIG";
+        case KBUILD_ERROR_COMPILING: return "KBUILD_ERROR_COMPILING";
+        case KBUILD_ERROR_OUTPUT_FILE_PATH_TOO_BIG: return "KBUILD_ERROR_OUTPUT_FILE_PATH_TOO_BIG";
+        case KBUILD_ERROR_EXTENSION_SIZE_TOO_BIG: return "KBUILD_ERROR_EXTENSION_SIZE_TOO_BIG";
+        case KBUILD_ERROR_INVALID_EXTENSION: return "KBUILD_ERROR_INVALID_EXTENSION";
+        case KBUILDER_ERROR_INVALID_PATH: return "KBUILDER_ERROR_INVALID_PATH";
+        case KBUILD_ERROR_LINKING: return "KBUILD_ERROR_LINKING";
+        case KBUILD_ERROR_COMPILE_DB: return "KBUILD_ERROR_COMPILE_DB";
+        case KBUILD_ERROR_SPAWNING: return "KBUILD_ERROR_SPAWNING";
+        case KBUILD_ERROR_INTERRUPTED: return "KBUILD_ERROR_INTERRUPTED";
+        case KBUILD_ERROR_WRITING_FILE: return "KBUILD_ERROR_WRITING_FILE";
+        case KBUILD_ERROR_EXECUTOR: return "KBUILD_ERROR_EXECUTOR";
+    }
+
+    return "KBUILD_ERROR_UNKNOWN";
+}
 
 int kbuild_is_dir(const char* path) {
     struct stat path_stat;
@@ -230,33 +1094,81 @@ int kbuild_is_dir(const char* path) {
     return S_ISDIR(path_stat.st_mode);
 }
 
-int kbuild_mkdir(const char* path) {
-    char tmp[KBUILD_PATH_MAX];
+/**
+  * Directories known to exist, the set owns its keys
+  */
+static KBUILD_HASHSET(kbuild_str_set) *kbuild_dir_cache = NULL;
 
-    char *pointer = NULL;
+static int kbuild_dir_cache_contains(const char *path) {
+    return kbuild_dir_cache != NULL && KBUILD_HASHSET_CONTAINS(kbuild_str_set, kbuild_dir_cache, path);
+}
 
-    int len = snprintf(tmp, sizeof(tmp), "%s", path);
-    if (len < 0) {
-        return -1;
+static void kbuild_dir_cache_add(const char *path) {
+    if (kbuild_dir_cache == NULL) {
+        kbuild_dir_cache = KBUILD_CREATE_HASHSET(kbuild_str_set);
     }
 
-    for (char *p = tmp; *p; p++) {
-        if (*p == KBUILD_DIRECTORY_SEPARATOR) {
-            *p = '\0';
+    if (!KBUILD_HASHSET_CONTAINS(kbuild_str_set, kbuild_dir_cache, path)) {
+        KBUILD_HASHSET_ADD(kbuild_str_set, kbuild_dir_cache, strdup(path));
+    }
+}
 
-            if (mkdir(tmp, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
-                return -1;
-            } 
+void kbuild_reset_dir_cache() {
+    if (kbuild_dir_cache == NULL) {
+        return;
+    }
 
-            *p = KBUILD_DIRECTORY_SEPARATOR;
+    for (int i = 0; i < kbuild_dir_cache->cap; i++) {
+        if (KBUILD_HASHMAP_SLOT_USED(kbuild_dir_cache, i)) {
+            free((char*)kbuild_dir_cache->keys[i]);
         }
     }
 
-    if (mkdir(tmp, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
-        return -1;
-    } 
-
-    return 0;
+    KBUILD_FREE_HASHSET(kbuild_str_set, kbuild_dir_cache);
+    kbuild_dir_cache = NULL;
+}
+
+int kbuild_mkdir(const char* path) {
+    char tmp[KBUILD_PATH_MAX];
+
+    if (kbuild_dir_cache_contains(path)) {
+        return 0;
+    }
+
+    int len = snprintf(tmp, sizeof(tmp), "%s", path);
+    if (len < 0 || len >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    // The current directory, it already exists
+    if (len == 0) {
+        return 0;
+    }
+
+    // The root of an absolute path has nothing to create
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == KBUILD_DIRECTORY_SEPARATOR) {
+            *p = '\0';
+
+            if (!kbuild_dir_cache_contains(tmp)) {
+                if (mkdir(tmp, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
+                    return -1;
+                }
+
+                kbuild_dir_cache_add(tmp);
+            }
+
+            *p = KBUILD_DIRECTORY_SEPARATOR;
+        }
+    }
+
+    if (mkdir(tmp, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
+        return -1;
+    } 
+
+    kbuild_dir_cache_add(tmp);
+
+    return 0;
 }
 
 KbuildPathInfo* kbuild_pathinfo(const char* path) {
@@ -376,6 +1288,9 @@ void kbuild_string_builder_appendn(KbuildStringBuilder * builder, const char* st
 
     if (new_len > builder->cap) {
         int new_cap = builder->cap * KBUILD_STRING_BUILDER_SCALE_FACTOR;
+        while (new_len > new_cap) {
+            new_cap *= KBUILD_STRING_BUILDER_SCALE_FACTOR;
+        }
 
         builder->buffer = realloc(builder->buffer, new_cap);
         builder->cap = new_cap;
@@ -404,6 +1319,34 @@ void kbuild_string_builder_append_ch(KbuildStringBuilder * builder, char ch) {
     builder->len = new_len;
 }
 
+void kbuild_string_builder_append_json(KbuildStringBuilder * builder, const char* str) {
+    assert(builder != NULL);
+    assert(str != NULL);
+
+    kbuild_string_builder_append_ch(builder, '"');
+
+    for (const char *p = str; *p; p++) {
+        unsigned char ch = *p;
+
+        if (ch == '"' || ch == '\\') {
+            kbuild_string_builder_append_ch(builder, '\\');
+            kbuild_string_builder_append_ch(builder, ch);
+        } else if (ch == '\n') {
+            kbuild_string_builder_append(builder, "\\n");
+        } else if (ch == '\t') {
+            kbuild_string_builder_append(builder, "\\t");
+        } else if (ch < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+            kbuild_string_builder_append(builder, escaped);
+        } else {
+            kbuild_string_builder_append_ch(builder, ch);
+        }
+    }
+
+    kbuild_string_builder_append_ch(builder, '"');
+}
+
 char * kbuild_string_builder_build(KbuildStringBuilder * builder) {
     assert(builder != NULL);
     assert(builder->buffer != NULL);
@@ -524,92 +1467,4170 @@ char *kbuild_join_separator(const char **strs, int strs_len, const char *separat
     return joined;
 }
 
-void kbuild_compile(const char* input_path, const char*output_path) {
-    char cmd[KBUILD_MAX_COMMAND_SIZE];
-    snprintf(cmd, KBUILD_MAX_COMMAND_SIZE, "%s -c -o %s %s %s", KBUILD_CC, output_path, input_path, KBUILD_CFLAGS);
-       
-    if (system(cmd) != 0) {
-        KBUILD_ERRORF(KBUILD_ERROR_COMPILING, "Could not compile %s\n", input_path);
+static int kbuild_emit_compile_commands = 0;
+
+void kbuild_set_emit_compile_commands(int enabled) {
+    kbuild_emit_compile_commands = enabled;
+}
+
+KbuildCompileDb *kbuild_compile_db_open(const char *build_path) {
+    assert(build_path != NULL);
+
+    char cwd[KBUILD_PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return NULL;
     }
+
+    KbuildCompileDb *db = malloc(sizeof(KbuildCompileDb));
+
+    const char *path_parts[2];
+    path_parts[0] = build_path;
+    path_parts[1] = KBUILD_COMPILE_DB_FILE_NAME;
+    db->path = kbuild_join_paths(path_parts, 2);
+
+    const char *tmp_path_parts[2];
+    tmp_path_parts[0] = db->path;
+    tmp_path_parts[1] = KBUILD_COMPILE_DB_TMP_EXTENSION;
+    db->tmp_path = kbuild_join(tmp_path_parts, 2);
+
+    db->directory = strdup(cwd);
+    db->previous = fopen(db->path, "rb");
+    db->file = NULL;
+    db->matched_bytes = 0;
+    db->entries = 0;
+    db->failed = 0;
+    db->entry = kbuild_create_string_builder();
+
+    return db;
 }
 
-KBUILD_DYNARR(kbuild_str_t) *kbuild_compile_files_in_dir(const char* input_path, const char* build_path) {
-    KBUILD_DYNARR(kbuild_str_t) *output_paths = KBUILD_CREATE_DYNARR(kbuild_str_t);
-    int build_path_len = strlen(build_path);
+/**
+  * Switches from comparing against the previous database to writing a new one,
+  * the part that matched so far is copied over as is
+  */
+static void kbuild_compile_db_diverge(KbuildCompileDb *db) {
+    db->file = fopen(db->tmp_path, "wb");
+    if (db->file == NULL) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_COMPILE_DB, "Could not open %s\n", db->tmp_path);
+        db->failed = 1;
+    }
 
-    // length of the build path + separator
-    if ((build_path_len + 1) >= KBUILD_MAX_OUTPUT_FULLPATH_SIZE) {
-        KBUILD_ERRORF(KBUILD_ERROR_OUTPUT_FILE_PATH_TOO_BIG, "For build path %s\n", build_path);
+    if (db->previous != NULL && db->file != NULL) {
+        char chunk[KBUILD_COMPILE_DB_COPY_CHUNK_SIZE];
+        long remaining = db->matched_bytes;
+
+        fseek(db->previous, 0, SEEK_SET);
+        while (remaining > 0) {
+            size_t to_read = remaining > (long)sizeof(chunk) ? sizeof(chunk) : (size_t)remaining;
+            size_t read = fread(chunk, 1, to_read, db->previous);
+            if (read == 0) {
+                break;
+            }
+
+            fwrite(chunk, 1, read, db->file);
+            remaining -= read;
+        }
     }
 
-    int output_extension_len = strlen(KBUILD_OBJECT_FILE_EXTENSION);
+    if (db->previous != NULL) {
+        fclose(db->previous);
+        db->previous = NULL;
+    }
+}
 
-    KBUILD_FOREACH_FILE(input_path, {
-        if (file_info.is_dir) {
-            KBUILD_DYNARR(kbuild_str_t) *children_objs = kbuild_compile_files_in_dir(file_info.full_path, build_path);
-            KBUILD_DYNARR_APPEND(output_paths, children_objs);
-            KBUILD_FREE_DYNARR(children_objs);
-        } else {
-            KbuildPathInfo *pathinfo = kbuild_pathinfo(file_info.full_path);
-            if (pathinfo == NULL) {
-                KBUILD_ERRORF(KBUILDER_ERROR_INVALID_PATH, "%s\n", file_info.full_path);
+static void kbuild_compile_db_write(KbuildCompileDb *db, const char *data, int len) {
+    if (db->failed) {
+        return;
+    }
+
+    if (db->file == NULL && db->previous != NULL) {
+        char chunk[KBUILD_COMPILE_DB_COPY_CHUNK_SIZE];
+        int compared = 0;
+
+        while (compared < len) {
+            int to_read = (len - compared) > (int)sizeof(chunk) ? (int)sizeof(chunk) : (len - compared);
+            if ((int)fread(chunk, 1, to_read, db->previous) != to_read || memcmp(chunk, data + compared, to_read) != 0) {
+                break;
             }
 
-            if (strcmp(pathinfo->extension, KBUILD_SOURCE_FILE_EXTENSION) == 0) {
-                const char *output_dir_paths_to_join[2];
-                output_dir_paths_to_join[0] = build_path;
-                output_dir_paths_to_join[1] = pathinfo->dirname;
-                char *output_full_dir_path = kbuild_join_paths(output_dir_paths_to_join, 2);
-                
-                kbuild_mkdir(output_full_dir_path);
+            compared += to_read;
+        }
 
-                const char *output_basename_parts[2];
-                output_basename_parts[0] = pathinfo->filename;
-                output_basename_parts[1] = KBUILD_OBJECT_FILE_EXTENSION_WITH_DOT;
-                char *output_basename = kbuild_join(output_basename_parts, 2);
-                
-                const char *output_file_paths_parts[2];
-                output_file_paths_parts[0] = output_full_dir_path;
-                output_file_paths_parts[1] = output_basename;
-                char *output_full_file_path = kbuild_join_paths(output_file_paths_parts, 2);
+        if (compared == len) {
+            db->matched_bytes += len;
+            return;
+        }
+    }
 
-                kbuild_compile(file_info.full_path, output_full_file_path);
-                KBUILD_DYNARR_PUSH_BACK(output_paths, output_full_file_path);
+    if (db->file == NULL) {
+        kbuild_compile_db_diverge(db);
+    }
 
-                free(output_basename);
-                free(output_full_dir_path);
+    if (db->file != NULL) {
+        fwrite(data, 1, len, db->file);
+    }
+}
+
+void kbuild_compile_db_add(KbuildCompileDb *db, const char *command, const char *input_path, const char *output_path) {
+    assert(db != NULL);
+    assert(command != NULL);
+    assert(input_path != NULL);
+    assert(output_path != NULL);
+
+    KbuildStringBuilder *entry = db->entry;
+    kbuild_string_builder_clear(entry);
+
+    kbuild_string_builder_append(entry, db->entries == 0 ? "[\n" : ",\n");
+    kbuild_string_builder_append(entry, "{\"directory\":");
+    kbuild_string_builder_append_json(entry, db->directory);
+    kbuild_string_builder_append(entry, ",\"command\":");
+    kbuild_string_builder_append_json(entry, command);
+    kbuild_string_builder_append(entry, ",\"file\":");
+    kbuild_string_builder_append_json(entry, input_path);
+    kbuild_string_builder_append(entry, ",\"output\":");
+    kbuild_string_builder_append_json(entry, output_path);
+    kbuild_string_builder_append_ch(entry, '}');
+
+    kbuild_compile_db_write(db, entry->buffer, entry->len);
+    db->entries++;
+}
+
+KbuildError kbuild_compile_db_close(KbuildCompileDb *db) {
+    assert(db != NULL);
+
+    const char *closing = db->entries == 0 ? "[\n]\n" : "\n]\n";
+    kbuild_compile_db_write(db, closing, strlen(closing));
+
+    // The previous database could still have entries that were not generated this time
+    if (db->file == NULL && db->previous != NULL && fgetc(db->previous) != EOF) {
+        kbuild_compile_db_diverge(db);
+    }
+
+    if (db->previous != NULL) {
+        fclose(db->previous);
+    }
+
+    if (db->file != NULL) {
+        if (fclose(db->file) != 0 || rename(db->tmp_path, db->path) != 0) {
+            KBUILD_LOG_ERRORF(KBUILD_ERROR_COMPILE_DB, "Could not write %s\n", db->path);
+            db->failed = 1;
+        }
+    }
+
+    KbuildError error = db->failed ? KBUILD_ERROR_COMPILE_DB : KBUILD_OK;
+
+    kbuild_free_string_builder(db->entry);
+    free(db->path);
+    free(db->tmp_path);
+    free(db->directory);
+    free(db);
+
+    return error;
+}
+
+static KBUILD_HASHMAP(kbuild_str_to_config) *kbuild_configs = NULL;
+static KBUILD_HASHSET(kbuild_flag_set_table) *kbuild_flag_sets = NULL;
+// Resolved flags by directory, or by file for files with a config of their own
+static KBUILD_HASHMAP(kbuild_str_to_flag_set) *kbuild_resolved_flags = NULL;
+
+static uint64_t kbuild_fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= KBUILD_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+uint64_t kbuild_hash_bytes(const void *data, size_t len) {
+    return kbuild_fnv1a(KBUILD_FNV_OFFSET_BASIS, data, len);
+}
+
+uint64_t kbuild_hash_string(const char *str) {
+    assert(str != NULL);
+    return kbuild_hash_bytes(str, strlen(str));
+}
+
+static void kbuild_free_strs(KBUILD_DYNARR(kbuild_str_t) *strs) {
+    for (int i = 0; i < strs->len; i++) {
+        free(strs->buffer[i]);
+    }
+
+    KBUILD_FREE_DYNARR(strs);
+}
+
+KbuildInternTable *kbuild_create_intern_table() {
+    KbuildInternTable *table = malloc(sizeof(KbuildInternTable));
+    table->ids = KBUILD_CREATE_HASHMAP(kbuild_str_to_int);
+    table->strs = KBUILD_CREATE_DYNARR(kbuild_str_t);
+
+    return table;
+}
+
+void kbuild_free_intern_table(KbuildInternTable *table) {
+    assert(table != NULL);
+
+    KBUILD_FREE_HASHMAP(kbuild_str_to_int, table->ids);
+    kbuild_free_strs(table->strs);
+    free(table);
+}
+
+int kbuild_intern(KbuildInternTable *table, const char *str) {
+    assert(table != NULL);
+    assert(str != NULL);
+
+    int slot = KBUILD_HASHMAP_FIND(kbuild_str_to_int, table->ids, str);
+    if (slot >= 0) {
+        return table->ids->values[slot];
+    }
+
+    // The copy lives in strs, so it does not move when the map grows
+    int id = table->strs->len;
+    char *copy = strdup(str);
+    KBUILD_DYNARR_PUSH_BACK(table->strs, copy);
+    KBUILD_HASHMAP_PUT(kbuild_str_to_int, table->ids, copy, id);
+
+    return id;
+}
+
+int kbuild_intern_path(KbuildInternTable *table, const char *path) {
+    assert(path != NULL);
+
+    char normalized[KBUILD_PATH_MAX];
+    int len = 0;
+
+    if (path[0] == KBUILD_DIRECTORY_SEPARATOR) {
+        normalized[len++] = KBUILD_DIRECTORY_SEPARATOR;
+    }
+
+    for (const char *p = path; *p != '\0';) {
+        if (*p == KBUILD_DIRECTORY_SEPARATOR) {
+            p++;
+            continue;
+        }
+
+        const char *component_end = strchr(p, KBUILD_DIRECTORY_SEPARATOR);
+        int component_len = component_end == NULL ? (int)strlen(p) : (int)(component_end - p);
+
+        if (!(component_len == 1 && p[0] == '.')) {
+            if (len + component_len + 2 > (int)sizeof(normalized)) {
+                // Too long to normalize, it is still unique as is
+                return kbuild_intern(table, path);
             }
 
-            kbuild_free_pathinfo(pathinfo);
+            if (len > 0 && normalized[len - 1] != KBUILD_DIRECTORY_SEPARATOR) {
+                normalized[len++] = KBUILD_DIRECTORY_SEPARATOR;
+            }
+
+            memcpy(normalized + len, p, component_len);
+            len += component_len;
         }
-    });
 
-    return output_paths;
+        p += component_len;
+    }
+
+    if (len == 0) {
+        normalized[len++] = '.';
+    }
+    normalized[len] = '\0';
+
+    return kbuild_intern(table, normalized);
 }
 
-void kbuild_link_files(KBUILD_DYNARR(kbuild_str_t) *object_files, const char *output_file_path) {
-    KBUILD_DYNARR(kbuild_str_t) *command_parts = KBUILD_CREATE_DYNARR(kbuild_str_t);
+int kbuild_intern_find(const KbuildInternTable *table, const char *str) {
+    assert(table != NULL);
+    assert(str != NULL);
+
+    int slot = KBUILD_HASHMAP_FIND(kbuild_str_to_int, table->ids, str);
+    return slot >= 0 ? table->ids->values[slot] : -1;
+}
 
-    KBUILD_DYNARR_PUSH_BACK(command_parts, KBUILD_CC);
-    KBUILD_DYNARR_PUSH_BACK(command_parts, KBUILD_CFLAGS);
-    KBUILD_DYNARR_PUSH_BACK(command_parts, KBUILD_LDFLAGS);
+const char *kbuild_interned_string(const KbuildInternTable *table, int id) {
+    assert(table != NULL);
+    assert(id >= 0 && id < table->strs->len);
 
-    KBUILD_DYNARR_PUSH_BACK(command_parts, "-o");
+    return table->strs->buffer[id];
+}
 
-    // output_file_path won't be modified, its safe to just cast the pointer
-    KBUILD_DYNARR_PUSH_BACK(command_parts, (char*)output_file_path);
+static KbuildConfig *kbuild_find_config(const char *normalized_path) {
+    if (kbuild_configs == NULL) {
+        return NULL;
+    }
 
-    KBUILD_DYNARR_APPEND(command_parts, object_files);
+    int slot = KBUILD_HASHMAP_FIND(kbuild_str_to_config, kbuild_configs, normalized_path);
+    return slot >= 0 ? kbuild_configs->values[slot] : NULL;
+}
 
-    char *cmd = kbuild_join_separator((const char**)command_parts->buffer, command_parts->len, " ");
+static void kbuild_forget_resolved_flags() {
+    if (kbuild_resolved_flags == NULL) {
+        return;
+    }
 
-    int status = system(cmd);
-    if (status != 0) {
-        KBUILD_ERROR(KBUILD_ERROR_LINKING);
+    for (int i = 0; i < kbuild_resolved_flags->cap; i++) {
+        if (KBUILD_HASHMAP_SLOT_USED(kbuild_resolved_flags, i)) {
+            free((char*)kbuild_resolved_flags->keys[i]);
+        }
     }
 
-    free(cmd);
-    KBUILD_FREE_DYNARR(command_parts);
+    KBUILD_FREE_HASHMAP(kbuild_str_to_flag_set, kbuild_resolved_flags);
+    kbuild_resolved_flags = NULL;
+}
+
+KbuildConfig *kbuild_config(const char *path) {
+    if (kbuild_configs == NULL) {
+        kbuild_configs = KBUILD_CREATE_HASHMAP(kbuild_str_to_config);
+    }
+
+    const char *paths[1];
+    paths[0] = path == NULL ? "" : path;
+    char *normalized_path = kbuild_join_paths(paths, 1);
+
+    KbuildConfig *existing = kbuild_find_config(normalized_path);
+    if (existing != NULL) {
+        free(normalized_path);
+        return existing;
+    }
+
+    kbuild_forget_resolved_flags();
+
+    KbuildConfig *config = malloc(sizeof(KbuildConfig));
+    config->path = normalized_path;
+    config->cc = NULL;
+    config->cflags = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    config->include_paths = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    config->defines = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    config->ldflags = KBUILD_CREATE_DYNARR(kbuild_str_t);
+
+    KBUILD_HASHMAP_PUT(kbuild_str_to_config, kbuild_configs, config->path, config);
+
+    return config;
+}
+
+void kbuild_config_set_cc(KbuildConfig *config, const char *cc) {
+    assert(config != NULL);
+    assert(cc != NULL);
+
+    kbuild_forget_resolved_flags();
+    free(config->cc);
+    config->cc = strdup(cc);
+}
+
+void kbuild_config_add_cflags(KbuildConfig *config, const char *cflags) {
+    assert(config != NULL);
+    assert(cflags != NULL);
+    kbuild_forget_resolved_flags();
+    KBUILD_DYNARR_PUSH_BACK(config->cflags, strdup(cflags));
+}
+
+void kbuild_config_add_include_path(KbuildConfig *config, const char *include_path) {
+    assert(config != NULL);
+    assert(include_path != NULL);
+    kbuild_forget_resolved_flags();
+    KBUILD_DYNARR_PUSH_BACK(config->include_paths, strdup(include_path));
+}
+
+void kbuild_config_add_define(KbuildConfig *config, const char *define) {
+    assert(config != NULL);
+    assert(define != NULL);
+    kbuild_forget_resolved_flags();
+    KBUILD_DYNARR_PUSH_BACK(config->defines, strdup(define));
+}
+
+void kbuild_config_add_ldflags(KbuildConfig *config, const char *ldflags) {
+    assert(config != NULL);
+    assert(ldflags != NULL);
+    KBUILD_DYNARR_PUSH_BACK(config->ldflags, strdup(ldflags));
+}
+
+static void kbuild_free_command_template(KbuildCommandTemplate *template);
+
+void kbuild_config_reset() {
+    kbuild_forget_resolved_flags();
+
+    if (kbuild_configs != NULL) {
+        for (int i = 0; i < kbuild_configs->cap; i++) {
+            if (!KBUILD_HASHMAP_SLOT_USED(kbuild_configs, i)) {
+                continue;
+            }
+
+            KbuildConfig *config = kbuild_configs->values[i];
+            free(config->path);
+            free(config->cc);
+            kbuild_free_strs(config->cflags);
+            kbuild_free_strs(config->include_paths);
+            kbuild_free_strs(config->defines);
+            kbuild_free_strs(config->ldflags);
+            free(config);
+        }
+
+        KBUILD_FREE_HASHMAP(kbuild_str_to_config, kbuild_configs);
+        kbuild_configs = NULL;
+    }
+
+    if (kbuild_flag_sets != NULL) {
+        for (int i = 0; i < kbuild_flag_sets->cap; i++) {
+            if (!KBUILD_HASHMAP_SLOT_USED(kbuild_flag_sets, i)) {
+                continue;
+            }
+
+            KbuildFlagSet *flag_set = (KbuildFlagSet*)kbuild_flag_sets->keys[i];
+            for (int j = 0; j < KBUILD_COMMAND_KIND_COUNT * 2; j++) {
+                kbuild_free_command_template(flag_set->templates[j]);
+            }
+            free(flag_set->cc);
+            free(flag_set->cflags);
+            free(flag_set);
+        }
+
+        KBUILD_FREE_HASHSET(kbuild_flag_set_table, kbuild_flag_sets);
+        kbuild_flag_sets = NULL;
+    }
+}
+
+const KbuildFlagSet *kbuild_intern_flag_set(const char *cc, const char *cflags) {
+    assert(cc != NULL);
+    assert(cflags != NULL);
+
+    if (kbuild_flag_sets == NULL) {
+        kbuild_flag_sets = KBUILD_CREATE_HASHSET(kbuild_flag_set_table);
+    }
+
+    // The terminator of cc is hashed too, so ("a", "b c") and ("a b", "c") differ
+    uint64_t id = kbuild_fnv1a(KBUILD_FNV_OFFSET_BASIS, cc, strlen(cc) + 1);
+    id = kbuild_fnv1a(id, cflags, strlen(cflags));
+
+    // The strings are only compared, never modified through the probe
+    KbuildFlagSet probe;
+    probe.id = id;
+    probe.cc = (char*)cc;
+    probe.cflags = (char*)cflags;
+
+    int slot = KBUILD_HASHMAP_FIND(kbuild_flag_set_table, kbuild_flag_sets, &probe);
+    if (slot >= 0) {
+        return kbuild_flag_sets->keys[slot];
+    }
+
+    KbuildFlagSet *flag_set = malloc(sizeof(KbuildFlagSet));
+    flag_set->id = id;
+    flag_set->cc = strdup(cc);
+    flag_set->cflags = strdup(cflags);
+    memset(flag_set->templates, 0, sizeof(flag_set->templates));
+
+    KBUILD_HASHSET_ADD(kbuild_flag_set_table, kbuild_flag_sets, flag_set);
+
+    return flag_set;
+}
+
+static int kbuild_split_dwarf = 0;
+static int kbuild_lto = 0;
+static long long kbuild_lto_cache_size = KBUILD_LTO_CACHE_MAX_SIZE;
+
+void kbuild_set_split_dwarf(int enabled) {
+    kbuild_forget_resolved_flags();
+    kbuild_split_dwarf = enabled;
+}
+
+void kbuild_set_lto(int enabled) {
+    kbuild_forget_resolved_flags();
+    kbuild_lto = enabled;
+}
+
+void kbuild_set_lto_cache_size(long long max_bytes) {
+    kbuild_lto_cache_size = max_bytes;
+}
+
+typedef struct {
+    int is_clang;
+    int major_version;
+} KbuildCompilerInfo;
+
+KBUILD_DECLARE_HASHMAP(kbuild_str_to_compiler, const char*, KbuildCompilerInfo);
+KBUILD_DEFINE_HASHMAP(kbuild_str_to_compiler, const char*, KbuildCompilerInfo, kbuild_hash_string, kbuild_str_eq);
+
+static KBUILD_HASHMAP(kbuild_str_to_compiler) *kbuild_compilers = NULL;
+
+/**
+  * Runs cmd through the shell and returns the first line it prints
+  */
+static int kbuild_read_command_line(const char *cmd, char *line, int line_size) {
+    FILE *pipe = popen(cmd, "r");
+    if (pipe == NULL) {
+        return -1;
+    }
+
+    int found = fgets(line, line_size, pipe) != NULL;
+    pclose(pipe);
+
+    return found ? 0 : -1;
+}
+
+/**
+  * Tells clang and gcc apart, they spell the LTO options differently
+  * The answer is cached for every compiler, it costs a process to find out.
+  */
+static KbuildCompilerInfo kbuild_compiler_info(const char *cc) {
+    if (kbuild_compilers == NULL) {
+        kbuild_compilers = KBUILD_CREATE_HASHMAP(kbuild_str_to_compiler);
+    }
+
+    int slot = KBUILD_HASHMAP_FIND(kbuild_str_to_compiler, kbuild_compilers, cc);
+    if (slot >= 0) {
+        return kbuild_compilers->values[slot];
+    }
+
+    KbuildCompilerInfo info = { 0, 0 };
+    char cmd[KBUILD_MAX_COMMAND_SIZE];
+    char line[256];
+
+    snprintf(cmd, sizeof(cmd), "%s --version 2>/dev/null", cc);
+    if (kbuild_read_command_line(cmd, line, sizeof(line)) == 0) {
+        info.is_clang = strstr(line, "clang") != NULL;
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s -dumpversion 2>/dev/null", cc);
+    if (kbuild_read_command_line(cmd, line, sizeof(line)) == 0) {
+        info.major_version = atoi(line);
+    }
+
+    // The map outlives the flag sets, it keeps its own copy of the key
+    KBUILD_HASHMAP_PUT(kbuild_str_to_compiler, kbuild_compilers, strdup(cc), info);
+
+    return info;
+}
+
+static void kbuild_append_flag(KbuildStringBuilder *builder, const char *prefix, const char *flag) {
+    if (flag[0] == '\0') {
+        return;
+    }
+
+    if (builder->len > 0) {
+        kbuild_string_builder_append_ch(builder, ' ');
+    }
+
+    kbuild_string_builder_append(builder, prefix);
+    kbuild_string_builder_append(builder, flag);
+}
+
+static const KbuildFlagSet *kbuild_compute_flags(const char *path) {
+    // Matching configs, from the outermost to the innermost: the global one,
+    // then one lookup per parent directory and the file itself
+    KBUILD_DYNARR(kbuild_config_ptr_t) *matching = KBUILD_CREATE_DYNARR(kbuild_config_ptr_t);
+
+    if (kbuild_configs != NULL) {
+        KbuildConfig *global_config = kbuild_find_config("");
+        if (global_config != NULL) {
+            KBUILD_DYNARR_PUSH_BACK(matching, global_config);
+        }
+
+        char prefix[KBUILD_PATH_MAX];
+        int path_len = strlen(path);
+
+        for (int i = 1; i <= path_len && i < (int)sizeof(prefix); i++) {
+            if (path[i] != '\0' && path[i] != KBUILD_DIRECTORY_SEPARATOR) {
+                continue;
+            }
+
+            memcpy(prefix, path, i);
+            prefix[i] = '\0';
+
+            KbuildConfig *config = kbuild_find_config(prefix);
+            if (config != NULL) {
+                KBUILD_DYNARR_PUSH_BACK(matching, config);
+            }
+        }
+    }
+
+    const char *cc = KBUILD_CC;
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_append_flag(builder, "", KBUILD_CFLAGS);
+
+    for (int i = 0; i < matching->len; i++) {
+        if (matching->buffer[i]->cc != NULL) {
+            cc = matching->buffer[i]->cc;
+        }
+
+        for (int j = 0; j < matching->buffer[i]->cflags->len; j++) {
+            kbuild_append_flag(builder, "", matching->buffer[i]->cflags->buffer[j]);
+        }
+    }
+
+    for (int i = 0; i < matching->len; i++) {
+        for (int j = 0; j < matching->buffer[i]->include_paths->len; j++) {
+            kbuild_append_flag(builder, "-I", matching->buffer[i]->include_paths->buffer[j]);
+        }
+    }
+
+    for (int i = 0; i < matching->len; i++) {
+        for (int j = 0; j < matching->buffer[i]->defines->len; j++) {
+            kbuild_append_flag(builder, "-D", matching->buffer[i]->defines->buffer[j]);
+        }
+    }
+
+    if (kbuild_split_dwarf) {
+        kbuild_append_flag(builder, "", "-gsplit-dwarf");
+    }
+
+    if (kbuild_lto) {
+        kbuild_append_flag(builder, "", kbuild_compiler_info(cc).is_clang ? "-flto=thin" : "-flto=auto");
+    }
+
+    char *cflags = kbuild_string_builder_build(builder);
+    const KbuildFlagSet *flag_set = kbuild_intern_flag_set(cc, cflags);
+
+    free(cflags);
+    kbuild_free_string_builder(builder);
+    KBUILD_FREE_DYNARR(matching);
+
+    return flag_set;
+}
+
+const KbuildFlagSet *kbuild_resolve_flags(const char *path) {
+    assert(path != NULL);
+
+    // Files without a config of their own get the flags of their directory,
+    // so one lookup serves the whole directory
+    char key[KBUILD_PATH_MAX];
+    int key_len = strlen(path);
+    if (key_len >= (int)sizeof(key)) {
+        return kbuild_compute_flags(path);
+    }
+
+    if (kbuild_configs == NULL || kbuild_find_config(path) == NULL) {
+        const char *separator = strrchr(path, KBUILD_DIRECTORY_SEPARATOR);
+        key_len = separator == NULL ? 0 : separator - path;
+    }
+
+    memcpy(key, path, key_len);
+    key[key_len] = '\0';
+
+    if (kbuild_resolved_flags == NULL) {
+        kbuild_resolved_flags = KBUILD_CREATE_HASHMAP(kbuild_str_to_flag_set);
+    }
+
+    int slot = KBUILD_HASHMAP_FIND(kbuild_str_to_flag_set, kbuild_resolved_flags, key);
+    if (slot >= 0) {
+        return kbuild_resolved_flags->values[slot];
+    }
+
+    const KbuildFlagSet *flag_set = kbuild_compute_flags(key);
+    KBUILD_HASHMAP_PUT(kbuild_str_to_flag_set, kbuild_resolved_flags, strdup(key), flag_set);
+
+    return flag_set;
+}
+
+static char *kbuild_resolve_ldflags() {
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_append_flag(builder, "", KBUILD_LDFLAGS);
+
+    KbuildConfig *global_config = kbuild_config("");
+    for (int i = 0; i < global_config->ldflags->len; i++) {
+        kbuild_append_flag(builder, "", global_config->ldflags->buffer[i]);
+    }
+
+    char *ldflags = kbuild_string_builder_build(builder);
+    kbuild_free_string_builder(builder);
+
+    return ldflags;
+}
+
+KBUILD_DYNARR(kbuild_str_t) *kbuild_parse_depfile(const char *path) {
+    assert(path != NULL);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    KBUILD_DYNARR(kbuild_str_t) *dependencies = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    KbuildStringBuilder *token = kbuild_create_string_builder();
+
+    // Everything up to the first token ending with ':' on a line is a target
+    int in_targets = 1;
+    int ch;
+
+    do {
+        ch = fgetc(file);
+
+        if (ch == '\\') {
+            int next = fgetc(file);
+
+            if (next == '\n') {
+                continue;
+            } else if (next == '\r') {
+                fgetc(file);
+                continue;
+            } else if (next == ' ' || next == '#' || next == '\\') {
+                kbuild_string_builder_append_ch(token, next);
+                continue;
+            }
+
+            kbuild_string_builder_append_ch(token, '\\');
+            if (next != EOF) {
+                ungetc(next, file);
+            }
+            continue;
+        }
+
+        if (ch == '$') {
+            int next = fgetc(file);
+            if (next != '$' && next != EOF) {
+                ungetc(next, file);
+            }
+
+            kbuild_string_builder_append_ch(token, '$');
+            continue;
+        }
+
+        if (ch != EOF && ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') {
+            kbuild_string_builder_append_ch(token, ch);
+            continue;
+        }
+
+        if (token->len > 0) {
+            if (in_targets) {
+                if (token->buffer[token->len - 1] == ':') {
+                    in_targets = 0;
+                }
+            } else {
+                KBUILD_DYNARR_PUSH_BACK(dependencies, kbuild_string_builder_build(token));
+            }
+
+            kbuild_string_builder_clear(token);
+        }
+
+        if (ch == '\n') {
+            in_targets = 1;
+        }
+    } while (ch != EOF);
+
+    kbuild_free_string_builder(token);
+    fclose(file);
+
+    return dependencies;
+}
+
+static char *kbuild_output_sidecar_path(const char *output_path, const char *extension) {
+    const char *parts[2];
+    parts[0] = output_path;
+    parts[1] = extension;
+
+    return kbuild_join(parts, 2);
+}
+
+static int kbuild_is_newer(const struct stat *a, const struct stat *b) {
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) {
+        return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    }
+
+    return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+}
+
+/**
+  * Reads the flag set id and, if cpu_seconds is not NULL, the CPU time the
+  * compile took (0 if it was not recorded)
+  */
+static int kbuild_read_stamp(const char *output_path, uint64_t *flags_id, double *cpu_seconds) {
+    char *stamp_path = kbuild_output_sidecar_path(output_path, KBUILD_STAMP_EXTENSION);
+    FILE *file = fopen(stamp_path, "r");
+    free(stamp_path);
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    unsigned long long id;
+    double cpu = 0;
+    int matched = fscanf(file, "flags %llx cpu %lf", &id, &cpu);
+    fclose(file);
+
+    if (matched < 1) {
+        return -1;
+    }
+
+    *flags_id = id;
+    if (cpu_seconds != NULL) {
+        *cpu_seconds = matched == 2 ? cpu : 0;
+    }
+
+    return 0;
+}
+
+static int kbuild_write_stamp(const char *output_path, const KbuildFlagSet *flags, double cpu_seconds) {
+    char *stamp_path = kbuild_output_sidecar_path(output_path, KBUILD_STAMP_EXTENSION);
+    FILE *file = fopen(stamp_path, "w");
+    free(stamp_path);
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "flags %016llx\n", (unsigned long long)flags->id);
+    fprintf(file, "cpu %.6f\n", cpu_seconds);
+    return fclose(file);
+}
+
+int kbuild_needs_compile(const char *input_path, const char *output_path, const KbuildFlagSet *flags) {
+    struct stat output_stat;
+    struct stat input_stat;
+
+    if (stat(output_path, &output_stat) != 0 || stat(input_path, &input_stat) != 0) {
+        return 1;
+    }
+
+    if (kbuild_is_newer(&input_stat, &output_stat)) {
+        return 1;
+    }
+
+    uint64_t stamp_flags_id;
+    if (kbuild_read_stamp(output_path, &stamp_flags_id, NULL) != 0 || stamp_flags_id != flags->id) {
+        return 1;
+    }
+
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    KBUILD_DYNARR(kbuild_str_t) *dependencies = kbuild_parse_depfile(depfile_path);
+    free(depfile_path);
+
+    if (dependencies == NULL) {
+        return 1;
+    }
+
+    int needs_compile = 0;
+    for (int i = 0; i < dependencies->len && !needs_compile; i++) {
+        struct stat dependency_stat;
+        if (stat(dependencies->buffer[i], &dependency_stat) != 0 || kbuild_is_newer(&dependency_stat, &output_stat)) {
+            needs_compile = 1;
+        }
+    }
+
+    kbuild_free_strs(dependencies);
+
+    return needs_compile;
+}
+
+static KbuildScheduler kbuild_scheduler = { -1, 0, 0, 0, 0, 0, 0, KBUILD_OK, NULL, NULL, 0, 0, NULL, NULL, 0 };
+static volatile sig_atomic_t kbuild_interrupted = 0;
+
+void kbuild_set_jobs(int max_jobs) {
+    kbuild_scheduler.max_jobs = max_jobs;
+}
+
+void kbuild_set_ordered_output(int enabled) {
+    kbuild_scheduler.ordered_output = enabled;
+}
+
+void kbuild_set_keep_going(int enabled) {
+    kbuild_scheduler.keep_going = enabled;
+}
+
+void kbuild_set_preprocess_jobs(int max_jobs) {
+    kbuild_scheduler.max_preprocess_jobs = max_jobs;
+}
+
+static void kbuild_interrupt_handler(int signal) {
+    (void)signal;
+    kbuild_interrupted = 1;
+}
+
+static struct sigaction kbuild_saved_sigint;
+static struct sigaction kbuild_saved_sigterm;
+static int kbuild_signals_trapped = 0;
+
+/**
+  * Jobs run in their own process groups, so an interrupt has to be forwarded
+  * by hand while they run. The previous handlers come back when the build
+  * ends, see kbuild_scheduler_release_signals.
+  */
+static void kbuild_scheduler_trap_signals() {
+    if (kbuild_signals_trapped) {
+        return;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = kbuild_interrupt_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &kbuild_saved_sigint);
+    sigaction(SIGTERM, &action, &kbuild_saved_sigterm);
+    kbuild_signals_trapped = 1;
+}
+
+static void kbuild_scheduler_release_signals() {
+    if (!kbuild_signals_trapped) {
+        return;
+    }
+
+    sigaction(SIGINT, &kbuild_saved_sigint, NULL);
+    sigaction(SIGTERM, &kbuild_saved_sigterm, NULL);
+    kbuild_signals_trapped = 0;
+}
+
+/**
+  * An interrupted build stops on the first error, even in keep going mode
+  */
+static int kbuild_scheduler_keeps_going() {
+    return kbuild_scheduler.keep_going && !kbuild_scheduler.interrupted;
+}
+
+static KbuildError kbuild_scheduler_init() {
+    kbuild_scheduler_trap_signals();
+
+    if (kbuild_scheduler.epoll_fd >= 0) {
+        return KBUILD_OK;
+    }
+
+    kbuild_scheduler.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (kbuild_scheduler.epoll_fd < 0) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_SPAWNING, "Could not create the epoll instance: %s\n", strerror(errno));
+        return KBUILD_ERROR_SPAWNING;
+    }
+
+    if (kbuild_scheduler.max_jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        kbuild_scheduler.max_jobs = cpus > 0 ? cpus : 1;
+    }
+
+    kbuild_scheduler.jobs = KBUILD_CREATE_DYNARR(kbuild_job_ptr_t);
+    kbuild_scheduler.failures = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    kbuild_scheduler.ready = KBUILD_CREATE_DYNARR(kbuild_job_ptr_t);
+    kbuild_scheduler.exiting = KBUILD_CREATE_DYNARR(kbuild_job_ptr_t);
+
+    return KBUILD_OK;
+}
+
+static KbuildExecutor *kbuild_executor = NULL;
+
+void kbuild_set_executor(KbuildExecutor *executor) {
+    kbuild_executor = executor;
+}
+
+void kbuild_free_executor(KbuildExecutor *executor) {
+    if (executor != NULL) {
+        executor->free(executor);
+    }
+}
+
+static KbuildAction *kbuild_create_action(KbuildExecutor *executor, const char *command) {
+    KbuildAction *action = malloc(sizeof(KbuildAction));
+    action->command = strdup(command);
+    action->inputs = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    action->outputs = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    action->env = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    action->fd = -1;
+    action->data = NULL;
+    action->executor = executor;
+
+    return action;
+}
+
+static void kbuild_add_action_env(KbuildAction *action, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + 2;
+    char *entry = malloc(size);
+    snprintf(entry, size, "%s=%s", name, value);
+    KBUILD_DYNARR_PUSH_BACK(action->env, entry);
+}
+
+static void kbuild_free_action(KbuildAction *action) {
+    if (action == NULL) {
+        return;
+    }
+
+    free(action->command);
+    kbuild_free_strs(action->inputs);
+    kbuild_free_strs(action->outputs);
+    kbuild_free_strs(action->env);
+    free(action);
+}
+
+static KbuildJob *kbuild_create_job(const char *description, KbuildError error_code) {
+    kbuild_scheduler_init();
+
+    KbuildJob *job = malloc(sizeof(KbuildJob));
+    job->pid = -1;
+    job->output_fd = -1;
+    job->sequence = -1;
+    job->status = 0;
+    job->finished = 0;
+    job->cancelled = 0;
+    job->error_code = error_code;
+    job->output = kbuild_create_string_builder();
+    job->description = strdup(description);
+    job->output_path = NULL;
+    job->flags = NULL;
+    job->timing_label = NULL;
+    job->elapsed = 0;
+    job->trace_path = NULL;
+    job->action = NULL;
+    job->argv = NULL;
+    job->compile_command = NULL;
+    job->compile_argv = NULL;
+    job->preprocessed_fd = -1;
+    job->preprocessing = 0;
+    job->pid_fd = -1;
+    memset(&job->usage, 0, sizeof(job->usage));
+
+    return job;
+}
+
+static void kbuild_free_job(KbuildJob *job) {
+    kbuild_free_string_builder(job->output);
+    free(job->description);
+    free(job->output_path);
+    free(job->trace_path);
+    kbuild_free_action(job->action);
+    free(job->argv);
+    free(job->compile_command);
+    free(job->compile_argv);
+    if (job->preprocessed_fd >= 0) {
+        close(job->preprocessed_fd);
+    }
+    free(job);
+}
+
+static void kbuild_write_all(int fd, const char *buffer, int len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buffer, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        buffer += written;
+        len -= written;
+    }
+}
+
+/**
+  * Removes whatever a failed or cancelled job could have left half written
+  */
+static void kbuild_job_remove_outputs(KbuildJob *job) {
+    if (job->output_path == NULL) {
+        return;
+    }
+
+    char *depfile_path = kbuild_output_sidecar_path(job->output_path, KBUILD_DEPFILE_EXTENSION);
+    char *tmp_output_path = kbuild_output_sidecar_path(job->output_path, KBUILD_TMP_EXTENSION);
+    char *tmp_depfile_path = kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION);
+
+    unlink(tmp_output_path);
+    if (job->flags != NULL) {
+        unlink(tmp_depfile_path);
+    }
+
+    // The previous output does not match the inputs anymore
+    if (!job->cancelled) {
+        unlink(job->output_path);
+        if (job->flags != NULL) {
+            unlink(depfile_path);
+        }
+    }
+
+    if (job->trace_path != NULL) {
+        unlink(job->trace_path);
+    }
+
+    free(depfile_path);
+    free(tmp_output_path);
+    free(tmp_depfile_path);
+}
+
+/**
+  * Moves the temporary outputs of a successful job into place
+  * The depfile goes first, so an interruption in between leaves the previous
+  * output with dependencies that are at least as recent.
+  */
+static int kbuild_job_commit_outputs(KbuildJob *job) {
+    int result = 0;
+
+    if (job->flags != NULL) {
+        char *depfile_path = kbuild_output_sidecar_path(job->output_path, KBUILD_DEPFILE_EXTENSION);
+        char *tmp_depfile_path = kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION);
+
+        result = rename(tmp_depfile_path, depfile_path);
+
+        free(depfile_path);
+        free(tmp_depfile_path);
+    }
+
+    char *tmp_output_path = kbuild_output_sidecar_path(job->output_path, KBUILD_TMP_EXTENSION);
+    if (result == 0) {
+        result = rename(tmp_output_path, job->output_path);
+    }
+    free(tmp_output_path);
+
+    return result;
+}
+
+void kbuild_cancel_jobs() {
+    if (kbuild_scheduler.jobs == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < kbuild_scheduler.jobs->len; i++) {
+        KbuildJob *job = kbuild_scheduler.jobs->buffer[i];
+        if (!job->finished && !job->cancelled) {
+            job->cancelled = 1;
+
+            // Preprocessed jobs waiting for the compile stage have no process,
+            // one that closed its output still runs until it is reaped
+            if (job->action != NULL) {
+                job->action->executor->cancel(job->action->executor, job->action);
+            } else if (job->pid > 0) {
+                kill(-job->pid, SIGTERM);
+            }
+        }
+    }
+}
+
+static void kbuild_scheduler_fail(KbuildError error) {
+    if (kbuild_scheduler.error == KBUILD_OK) {
+        kbuild_scheduler.error = error;
+    }
+
+    if (!kbuild_scheduler_keeps_going()) {
+        kbuild_cancel_jobs();
+    }
+}
+
+/**
+  * Writes the captured output of finished jobs, each one with a single write so
+  * they never interleave. In ordered mode a job waits for all the ones
+  * submitted before it.
+  */
+static void kbuild_scheduler_flush() {
+    KBUILD_DYNARR(kbuild_job_ptr_t) *jobs = kbuild_scheduler.jobs;
+
+    for (;;) {
+        int index = -1;
+        for (int i = 0; i < jobs->len; i++) {
+            KbuildJob *job = jobs->buffer[i];
+            if (job->finished && (job->cancelled || !kbuild_scheduler.ordered_output || job->sequence == kbuild_scheduler.next_flush)) {
+                index = i;
+                break;
+            }
+        }
+
+        if (index < 0) {
+            return;
+        }
+
+        KbuildJob *job = jobs->buffer[index];
+        for (int i = index + 1; i < jobs->len; i++) {
+            jobs->buffer[i - 1] = jobs->buffer[i];
+        }
+        jobs->len--;
+
+        if (job->sequence >= kbuild_scheduler.next_flush) {
+            kbuild_scheduler.next_flush = job->sequence + 1;
+        }
+
+        // A cancelled job only has the noise of being killed to show
+        if (!job->cancelled) {
+            kbuild_write_all(STDERR_FILENO, job->output->buffer, job->output->len);
+        }
+
+        if (!job->cancelled && job->status != 0) {
+            if (job->error_code == KBUILD_ERROR_LINKING) {
+                KBUILD_LOG_ERRORF(KBUILD_ERROR_LINKING, "Could not link %s\n", job->description);
+            } else {
+                KBUILD_LOG_ERRORF(KBUILD_ERROR_COMPILING, "Could not compile %s\n", job->description);
+            }
+
+            KBUILD_DYNARR_PUSH_BACK(kbuild_scheduler.failures, strdup(job->description));
+            kbuild_scheduler_fail(job->error_code);
+        }
+
+        kbuild_free_job(job);
+    }
+}
+
+static KBUILD_DYNARR(kbuild_job_stats_ptr_t) *kbuild_all_job_stats = NULL;
+
+static double kbuild_timeval_seconds(struct timeval time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+static void kbuild_record_job_stats(const KbuildJob *job) {
+    if (kbuild_all_job_stats == NULL) {
+        kbuild_all_job_stats = KBUILD_CREATE_DYNARR(kbuild_job_stats_ptr_t);
+    }
+
+    KbuildJobStats *stats = malloc(sizeof(KbuildJobStats));
+    stats->description = strdup(job->description);
+    stats->kind = job->flags != NULL ? "compile" : job->error_code == KBUILD_ERROR_LINKING ? "link" : "other";
+    stats->status = job->status;
+    stats->wall_seconds = job->elapsed;
+    stats->user_seconds = kbuild_timeval_seconds(job->usage.ru_utime);
+    stats->system_seconds = kbuild_timeval_seconds(job->usage.ru_stime);
+    stats->max_rss_kb = job->usage.ru_maxrss;
+    stats->in_blocks = job->usage.ru_inblock;
+    stats->out_blocks = job->usage.ru_oublock;
+
+    KBUILD_DYNARR_PUSH_BACK(kbuild_all_job_stats, stats);
+}
+
+const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *kbuild_job_stats() {
+    if (kbuild_all_job_stats == NULL) {
+        kbuild_all_job_stats = KBUILD_CREATE_DYNARR(kbuild_job_stats_ptr_t);
+    }
+
+    return kbuild_all_job_stats;
+}
+
+void kbuild_reset_job_stats() {
+    if (kbuild_all_job_stats == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < kbuild_all_job_stats->len; i++) {
+        free(kbuild_all_job_stats->buffer[i]->description);
+        free(kbuild_all_job_stats->buffer[i]);
+    }
+
+    KBUILD_FREE_DYNARR(kbuild_all_job_stats);
+    kbuild_all_job_stats = NULL;
+}
+
+static int kbuild_compare_job_stats_cpu(const void *a, const void *b) {
+    const KbuildJobStats *stats_a = *(const KbuildJobStats**)a;
+    const KbuildJobStats *stats_b = *(const KbuildJobStats**)b;
+    double cpu_a = stats_a->user_seconds + stats_a->system_seconds;
+    double cpu_b = stats_b->user_seconds + stats_b->system_seconds;
+
+    if (cpu_a != cpu_b) {
+        return cpu_a > cpu_b ? -1 : 1;
+    }
+
+    return strcmp(stats_a->description, stats_b->description);
+}
+
+void kbuild_print_job_summary(int top_n) {
+    const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *all_stats = kbuild_job_stats();
+    if (all_stats->len == 0) {
+        return;
+    }
+
+    // Sorted on a copy, the stats stay in the order the jobs finished
+    int len = all_stats->len;
+    KbuildJobStats **sorted = malloc(sizeof(KbuildJobStats*) * len);
+    memcpy(sorted, all_stats->buffer, sizeof(KbuildJobStats*) * len);
+    qsort(sorted, len, sizeof(KbuildJobStats*), kbuild_compare_job_stats_cpu);
+
+    double total_cpu = 0;
+    double total_wall = 0;
+    long max_rss_kb = 0;
+    for (int i = 0; i < len; i++) {
+        total_cpu += sorted[i]->user_seconds + sorted[i]->system_seconds;
+        total_wall += sorted[i]->wall_seconds;
+        if (sorted[i]->max_rss_kb > max_rss_kb) {
+            max_rss_kb = sorted[i]->max_rss_kb;
+        }
+    }
+
+    fprintf(stderr, "%8s %8s %10s %8s %8s  %s\n", "cpu", "wall", "rss", "in", "out", "job");
+    for (int i = 0; i < len && i < top_n; i++) {
+        KbuildJobStats *stats = sorted[i];
+        fprintf(stderr, "%7.3fs %7.3fs %7.1fMiB %8ld %8ld  %s\n",
+                stats->user_seconds + stats->system_seconds, stats->wall_seconds, stats->max_rss_kb / 1024.0,
+                stats->in_blocks, stats->out_blocks, stats->description);
+    }
+    fprintf(stderr, "%d jobs, %.3fs cpu, %.3fs wall in jobs, %.1fMiB peak rss\n", len, total_cpu, total_wall, max_rss_kb / 1024.0);
+
+    free(sorted);
+}
+
+static void kbuild_write_csv_field(FILE *file, const char *str) {
+    fputc('"', file);
+    for (const char *p = str; *p != '\0'; p++) {
+        if (*p == '"') {
+            fputc('"', file);
+        }
+        fputc(*p, file);
+    }
+    fputc('"', file);
+}
+
+KbuildError kbuild_write_job_stats(const char *path) {
+    assert(path != NULL);
+
+    const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *all_stats = kbuild_job_stats();
+
+    int path_len = strlen(path);
+    int is_json = path_len >= 5 && strcmp(path + path_len - 5, ".json") == 0;
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_WRITING_FILE, "Could not open %s: %s\n", path, strerror(errno));
+        return KBUILD_ERROR_WRITING_FILE;
+    }
+
+    if (is_json) {
+        KbuildStringBuilder *builder = kbuild_create_string_builder();
+
+        fputs("[\n", file);
+        for (int i = 0; i < all_stats->len; i++) {
+            KbuildJobStats *stats = all_stats->buffer[i];
+
+            kbuild_string_builder_clear(builder);
+            kbuild_string_builder_append_json(builder, stats->description);
+            char *description = kbuild_string_builder_build(builder);
+
+            fprintf(file, "%s{\"job\":%s,\"kind\":\"%s\",\"status\":%d,\"wall_seconds\":%.6f,\"user_seconds\":%.6f,"
+                    "\"system_seconds\":%.6f,\"max_rss_kb\":%ld,\"in_blocks\":%ld,\"out_blocks\":%ld}",
+                    i > 0 ? ",\n" : "", description, stats->kind, stats->status, stats->wall_seconds, stats->user_seconds,
+                    stats->system_seconds, stats->max_rss_kb, stats->in_blocks, stats->out_blocks);
+
+            free(description);
+        }
+        fputs(all_stats->len > 0 ? "\n]\n" : "]\n", file);
+
+        kbuild_free_string_builder(builder);
+    } else {
+        fputs("job,kind,status,wall_seconds,user_seconds,system_seconds,max_rss_kb,in_blocks,out_blocks\n", file);
+        for (int i = 0; i < all_stats->len; i++) {
+            KbuildJobStats *stats = all_stats->buffer[i];
+
+            kbuild_write_csv_field(file, stats->description);
+            fprintf(file, ",%s,%d,%.6f,%.6f,%.6f,%ld,%ld,%ld\n", stats->kind, stats->status, stats->wall_seconds,
+                    stats->user_seconds, stats->system_seconds, stats->max_rss_kb, stats->in_blocks, stats->out_blocks);
+        }
+    }
+
+    if (fclose(file) != 0) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_WRITING_FILE, "Could not write %s: %s\n", path, strerror(errno));
+        return KBUILD_ERROR_WRITING_FILE;
+    }
+
+    return KBUILD_OK;
+}
+
+static int kbuild_hermetic = 0;
+static char *kbuild_tracer_path = NULL;
+
+void kbuild_set_hermetic(int enabled) {
+    kbuild_hermetic = enabled;
+}
+
+/**
+  * Checks if path is dir itself or inside it, both already resolved
+  */
+static int kbuild_path_is_under(const char *path, const char *dir) {
+    int dir_len = strlen(dir);
+    if (strncmp(path, dir, dir_len) != 0) {
+        return 0;
+    }
+
+    return path[dir_len] == '\0' || path[dir_len] == KBUILD_DIRECTORY_SEPARATOR || (dir_len == 1 && dir[0] == KBUILD_DIRECTORY_SEPARATOR);
+}
+
+static void kbuild_depfile_append_path(KbuildStringBuilder *builder, const char *path) {
+    kbuild_string_builder_append_ch(builder, ' ');
+
+    for (const char *p = path; *p != '\0'; p++) {
+        if (*p == ' ' || *p == '#' || *p == '\\') {
+            kbuild_string_builder_append_ch(builder, '\\');
+        } else if (*p == '$') {
+            kbuild_string_builder_append_ch(builder, '$');
+        }
+        kbuild_string_builder_append_ch(builder, *p);
+    }
+}
+
+/**
+  * Directories the compile may read project files from: the one of the source
+  * and every -I, -iquote, -isystem and -idirafter directory, plus the files
+  * of -include, all resolved
+  */
+static KBUILD_DYNARR(kbuild_str_t) *kbuild_declared_input_dirs(const KbuildFlagSet *flags, const char *real_source_path) {
+    KBUILD_DYNARR(kbuild_str_t) *dirs = KBUILD_CREATE_DYNARR(kbuild_str_t);
+
+    const char *source_dir_end = strrchr(real_source_path, KBUILD_DIRECTORY_SEPARATOR);
+    KBUILD_DYNARR_PUSH_BACK(dirs, strndup(real_source_path, source_dir_end - real_source_path));
+
+    const char *prefixes[] = { "-I", "-iquote", "-isystem", "-idirafter", "-include" };
+    const char *p = flags->cflags;
+
+    while (*p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
+
+        const char *token_end = strchr(p, ' ');
+        int token_len = token_end == NULL ? (int)strlen(p) : (int)(token_end - p);
+
+        for (int i = 0; i < (int)(sizeof(prefixes) / sizeof(prefixes[0])); i++) {
+            int prefix_len = strlen(prefixes[i]);
+            if (token_len < prefix_len || strncmp(p, prefixes[i], prefix_len) != 0) {
+                continue;
+            }
+
+            const char *value = p + prefix_len;
+            int value_len = token_len - prefix_len;
+
+            // Separate argument, as in "-I dir"
+            if (value_len == 0 && token_end != NULL) {
+                value = token_end + 1;
+                const char *value_end = strchr(value, ' ');
+                value_len = value_end == NULL ? (int)strlen(value) : (int)(value_end - value);
+                token_len = (value + value_len) - p;
+            }
+
+            char *dir = strndup(value, value_len);
+            char *real_dir = realpath(dir, NULL);
+            if (real_dir != NULL) {
+                KBUILD_DYNARR_PUSH_BACK(dirs, real_dir);
+            }
+            free(dir);
+            break;
+        }
+
+        p += token_len;
+    }
+
+    return dirs;
+}
+
+/**
+  * Turns the trace of a successful hermetic compile into its depfile
+  * The inputs are the files read and never written by the job that still
+  * exist, which leaves out the temporary files passed between the driver,
+  * the compiler and the assembler.
+  */
+static int kbuild_job_store_traced_inputs(KbuildJob *job, const char *input_path) {
+    FILE *trace = fopen(job->trace_path, "r");
+    if (trace == NULL) {
+        kbuild_string_builder_append(job->output, "The file access tracer did not record anything\n");
+        return -1;
+    }
+
+    KbuildInternTable *read_paths = kbuild_create_intern_table();
+    KBUILD_HASHSET(kbuild_str_set) *written_paths = KBUILD_CREATE_HASHSET(kbuild_str_set);
+    KBUILD_DYNARR(kbuild_str_t) *written_strs = KBUILD_CREATE_DYNARR(kbuild_str_t);
+
+    char line[KBUILD_PATH_MAX + 4];
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        int len = strlen(line);
+        if (len < 3 || line[len - 1] != '\n') {
+            continue;
+        }
+        line[len - 1] = '\0';
+
+        char *real_path = realpath(line + 2, NULL);
+        if (real_path == NULL) {
+            continue;
+        }
+
+        if (line[0] == 'w') {
+            if (!KBUILD_HASHSET_CONTAINS(kbuild_str_set, written_paths, real_path)) {
+                KBUILD_DYNARR_PUSH_BACK(written_strs, real_path);
+                KBUILD_HASHSET_ADD(kbuild_str_set, written_paths, real_path);
+                continue;
+            }
+        } else if (!kbuild_is_dir(real_path)) {
+            kbuild_intern(read_paths, real_path);
+        }
+
+        free(real_path);
+    }
+    fclose(trace);
+
+    char cwd[KBUILD_PATH_MAX];
+    char *real_source_path = realpath(input_path, NULL);
+    int result = 0;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL || real_source_path == NULL) {
+        kbuild_string_builder_append(job->output, "Could not resolve the traced inputs\n");
+        result = -1;
+    } else {
+        KBUILD_DYNARR(kbuild_str_t) *declared_dirs = kbuild_declared_input_dirs(job->flags, real_source_path);
+        int cwd_len = strlen(cwd);
+
+        // The source first, like the depfiles the compilers write
+        KbuildStringBuilder *depfile = kbuild_create_string_builder();
+        kbuild_depfile_append_path(depfile, job->output_path);
+        kbuild_string_builder_append_ch(depfile, ':');
+        kbuild_depfile_append_path(depfile, input_path);
+
+        for (int i = 0; i < read_paths->strs->len; i++) {
+            const char *real_path = read_paths->strs->buffer[i];
+            if (strcmp(real_path, real_source_path) == 0 || KBUILD_HASHSET_CONTAINS(kbuild_str_set, written_paths, real_path)) {
+                continue;
+            }
+
+            int in_project = kbuild_path_is_under(real_path, cwd);
+            kbuild_string_builder_append(depfile, " \\\n ");
+            kbuild_depfile_append_path(depfile, in_project ? real_path + cwd_len + 1 : real_path);
+
+            // Files outside the project belong to the toolchain and the system
+            int declared = !in_project;
+            for (int j = 0; j < declared_dirs->len && !declared; j++) {
+                declared = kbuild_path_is_under(real_path, declared_dirs->buffer[j]);
+            }
+
+            if (!declared) {
+                char message[KBUILD_PATH_MAX * 2 + 64];
+                snprintf(message, sizeof(message), "Undeclared input %s read while compiling %s\n", real_path + cwd_len + 1, input_path);
+                kbuild_string_builder_append(job->output, message);
+            }
+        }
+        kbuild_string_builder_append_ch(depfile, '\n');
+
+        char *depfile_path = kbuild_output_sidecar_path(job->output_path, KBUILD_DEPFILE_EXTENSION);
+        char *tmp_depfile_path = kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION);
+
+        // Skips the separator in front of the target
+        FILE *file = fopen(tmp_depfile_path, "w");
+        if (file == NULL || fwrite(depfile->buffer + 1, 1, depfile->len - 1, file) != (size_t)(depfile->len - 1)) {
+            kbuild_string_builder_append(job->output, "Could not write the traced dependencies\n");
+            result = -1;
+        }
+        if (file != NULL && fclose(file) != 0) {
+            result = -1;
+        }
+
+        free(depfile_path);
+        free(tmp_depfile_path);
+        kbuild_free_string_builder(depfile);
+        kbuild_free_strs(declared_dirs);
+    }
+
+    unlink(job->trace_path);
+
+    free(real_source_path);
+    kbuild_free_intern_table(read_paths);
+    KBUILD_FREE_HASHSET(kbuild_str_set, written_paths);
+    kbuild_free_strs(written_strs);
+
+    return result;
+}
+
+static void kbuild_job_complete(KbuildJob *job) {
+    if (job->status == 0 && !job->cancelled && job->trace_path != NULL && kbuild_job_store_traced_inputs(job, job->description) != 0) {
+        job->status = 1;
+    }
+
+    if (job->status == 0 && !job->cancelled && job->output_path != NULL && kbuild_job_commit_outputs(job) != 0) {
+        char message[KBUILD_PATH_MAX + 64];
+        snprintf(message, sizeof(message), "Could not move %s into place: %s\n", job->output_path, strerror(errno));
+        kbuild_string_builder_append(job->output, message);
+        job->status = 1;
+    }
+
+    // Recorded once nothing can fail the job anymore, so the stats show its final status
+    kbuild_record_job_stats(job);
+
+    if (job->status != 0 || job->cancelled) {
+        kbuild_job_remove_outputs(job);
+        return;
+    }
+
+    if (job->timing_label != NULL) {
+        char message[KBUILD_PATH_MAX + 64];
+        snprintf(message, sizeof(message), "%s %s in %.3fs\n", job->timing_label, job->description, job->elapsed);
+        kbuild_string_builder_append(job->output, message);
+    }
+
+    if (job->flags == NULL) {
+        return;
+    }
+
+    double cpu_seconds = kbuild_timeval_seconds(job->usage.ru_utime) + kbuild_timeval_seconds(job->usage.ru_stime);
+    kbuild_write_stamp(job->output_path, job->flags, cpu_seconds);
+
+    // Keep the warnings around so they can be shown again when the job is skipped
+    char *log_path = kbuild_output_sidecar_path(job->output_path, KBUILD_LOG_EXTENSION);
+    if (job->output->len > 0) {
+        FILE *log = fopen(log_path, "wb");
+        if (log != NULL) {
+            fwrite(job->output->buffer, 1, job->output->len, log);
+            fclose(log);
+        }
+    } else {
+        unlink(log_path);
+    }
+    free(log_path);
+}
+
+static void kbuild_add_rusage(struct rusage *total, const struct rusage *stage) {
+    total->ru_utime.tv_sec += stage->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += stage->ru_utime.tv_usec;
+    total->ru_stime.tv_sec += stage->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += stage->ru_stime.tv_usec;
+
+    if (total->ru_utime.tv_usec >= 1000000) {
+        total->ru_utime.tv_sec++;
+        total->ru_utime.tv_usec -= 1000000;
+    }
+    if (total->ru_stime.tv_usec >= 1000000) {
+        total->ru_stime.tv_sec++;
+        total->ru_stime.tv_usec -= 1000000;
+    }
+
+    if (stage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = stage->ru_maxrss;
+    }
+    total->ru_inblock += stage->ru_inblock;
+    total->ru_oublock += stage->ru_oublock;
+}
+
+/**
+  * Collects the exit status of a job whose output is closed, without
+  * waiting. Returns 0 when the process has not exited yet.
+  */
+static int kbuild_job_reap(KbuildJob *job) {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(job->pid, &status, WNOHANG, &usage)) < 0 && errno == EINTR);
+
+    if (pid == 0) {
+        return 0;
+    }
+
+    // The pid may be reused from here on, nothing must signal it anymore
+    job->pid = -1;
+
+    if (job->pid_fd >= 0) {
+        epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_DEL, job->pid_fd, NULL);
+        close(job->pid_fd);
+        job->pid_fd = -1;
+    }
+
+    // A pipelined compile adds up both of its stages
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->elapsed += (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+
+    if (pid < 0) {
+        job->status = 1;
+    } else if (WIFEXITED(status)) {
+        kbuild_add_rusage(&job->usage, &usage);
+        job->status = WEXITSTATUS(status);
+    } else {
+        kbuild_add_rusage(&job->usage, &usage);
+        job->status = 128 + WTERMSIG(status);
+    }
+
+    if (job->preprocessing) {
+        job->preprocessing = 0;
+        kbuild_scheduler.running_preprocess--;
+
+        // The compile stage starts with the next free slot, see kbuild_scheduler_start_ready
+        if (job->status == 0 && !job->cancelled) {
+            KBUILD_DYNARR_PUSH_BACK(kbuild_scheduler.ready, job);
+            return 1;
+        }
+    } else {
+        kbuild_scheduler.running--;
+    }
+
+    job->finished = 1;
+    kbuild_job_complete(job);
+    return 1;
+}
+
+/**
+  * Descriptor that becomes readable when the process exits, -1 when the
+  * kernel has no pidfds
+  */
+static int kbuild_open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/**
+  * Waits for the process of a job whose output is closed through the epoll
+  * instance, or by polling when there are no pidfds
+  */
+static void kbuild_job_wait_exit(KbuildJob *job) {
+    if (kbuild_job_reap(job)) {
+        return;
+    }
+
+    job->pid_fd = kbuild_open_pidfd(job->pid);
+    if (job->pid_fd >= 0) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = job;
+
+        if (epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_ADD, job->pid_fd, &event) == 0) {
+            return;
+        }
+
+        close(job->pid_fd);
+        job->pid_fd = -1;
+    }
+
+    KBUILD_DYNARR_PUSH_BACK(kbuild_scheduler.exiting, job);
+}
+
+static void kbuild_scheduler_reap_exiting() {
+    KBUILD_DYNARR(kbuild_job_ptr_t) *exiting = kbuild_scheduler.exiting;
+    int kept = 0;
+
+    for (int i = 0; i < exiting->len; i++) {
+        if (!kbuild_job_reap(exiting->buffer[i])) {
+            exiting->buffer[kept++] = exiting->buffer[i];
+        }
+    }
+
+    exiting->len = kept;
+}
+
+/**
+  * Gets the result of a job that ran on the executor once its descriptor
+  * became readable. The outputs are back in place before anything looks at
+  * them.
+  */
+static void kbuild_job_collect(KbuildJob *job) {
+    KbuildAction *action = job->action;
+    epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_DEL, action->fd, NULL);
+
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    int status = 1;
+    KbuildError error = action->executor->collect(action->executor, action, &status, &usage, job->output);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->elapsed += (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+    kbuild_add_rusage(&job->usage, &usage);
+    job->status = status;
+
+    if (error != KBUILD_OK && job->status == 0 && !job->cancelled) {
+        kbuild_string_builder_append(job->output, "Could not collect the outputs from the executor\n");
+        job->status = 1;
+    }
+
+    kbuild_scheduler.running--;
+    job->finished = 1;
+    kbuild_job_complete(job);
+}
+
+static void kbuild_job_read(KbuildJob *job) {
+    if (job->action != NULL) {
+        kbuild_job_collect(job);
+        return;
+    }
+
+    // Only the pidfd is left once the output is closed
+    if (job->output_fd < 0) {
+        kbuild_job_reap(job);
+        return;
+    }
+
+    char chunk[KBUILD_JOB_READ_CHUNK_SIZE + 1];
+
+    for (;;) {
+        ssize_t bytes_read = read(job->output_fd, chunk, KBUILD_JOB_READ_CHUNK_SIZE);
+
+        if (bytes_read > 0) {
+            chunk[bytes_read] = '\0';
+            kbuild_string_builder_appendn(job->output, chunk, bytes_read);
+            continue;
+        }
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes_read < 0 && errno == EAGAIN) {
+            return;
+        }
+
+        // End of the output, the process is done (or about to be)
+        epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_DEL, job->output_fd, NULL);
+        close(job->output_fd);
+        job->output_fd = -1;
+
+        kbuild_job_wait_exit(job);
+        return;
+    }
+}
+
+/**
+  * An interrupt always stops the build, even in keep going mode
+  */
+static void kbuild_scheduler_check_interrupt() {
+    if (kbuild_interrupted) {
+        kbuild_interrupted = 0;
+        kbuild_scheduler.interrupted = 1;
+        kbuild_scheduler_fail(KBUILD_ERROR_INTERRUPTED);
+    }
+}
+
+static void kbuild_scheduler_start_ready();
+
+/**
+  * Waits until at least one running job makes progress
+  */
+static void kbuild_scheduler_poll() {
+    struct epoll_event events[KBUILD_MAX_EPOLL_EVENTS];
+
+    // Processes that closed their output but have not exited are polled for
+    int timeout = kbuild_scheduler.exiting->len > 0 ? KBUILD_REAP_INTERVAL_MS : -1;
+    int count = epoll_wait(kbuild_scheduler.epoll_fd, events, KBUILD_MAX_EPOLL_EVENTS, timeout);
+    kbuild_scheduler_check_interrupt();
+    kbuild_scheduler_reap_exiting();
+
+    if (count < 0) {
+        if (errno != EINTR) {
+            KBUILD_LOG_ERRORF(KBUILD_ERROR_SPAWNING, "epoll_wait failed: %s\n", strerror(errno));
+            kbuild_scheduler_fail(KBUILD_ERROR_SPAWNING);
+        }
+
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        kbuild_job_read(events[i].data.ptr);
+    }
+
+    kbuild_scheduler_start_ready();
+    kbuild_scheduler_flush();
+}
+
+/**
+  * Forks the process of job, running job->argv directly or cmd through the
+  * shell when there is no argv. Its stdout and stderr go to a pipe the
+  * scheduler polls, stdin_fd and stdout_fd replace the standard streams when
+  * they are not -1.
+  */
+static KbuildError kbuild_job_spawn(KbuildJob *job, const char *cmd, int stdin_fd, int stdout_fd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_SPAWNING, "Could not create a pipe: %s\n", strerror(errno));
+        return KBUILD_ERROR_SPAWNING;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_SPAWNING, "Could not fork: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return KBUILD_ERROR_SPAWNING;
+    }
+
+    if (pid == 0) {
+        // Own process group, so cancelling also reaches the processes the compiler driver spawns
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        if (stdin_fd >= 0) {
+            dup2(stdin_fd, STDIN_FILENO);
+        }
+        dup2(stdout_fd >= 0 ? stdout_fd : fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+
+        // Inherited by every process the compiler driver spawns
+        if (job->trace_path != NULL) {
+            setenv("LD_PRELOAD", kbuild_tracer_path, 1);
+            setenv("KBUILD_TRACE_FILE", job->trace_path, 1);
+        }
+
+        if (job->argv != NULL) {
+            execvp(job->argv[0], job->argv);
+            fprintf(stderr, "Could not run %s: %s\n", job->argv[0], strerror(errno));
+        } else {
+            execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        }
+        _exit(127);
+    }
+
+    // Set from both sides, kill(-pid) must work as soon as fork returns
+    setpgid(pid, pid);
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    job->pid = pid;
+    job->output_fd = fds[0];
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = job;
+    epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_ADD, job->output_fd, &event);
+
+    if (job->preprocessing) {
+        kbuild_scheduler.running_preprocess++;
+    } else {
+        kbuild_scheduler.running++;
+    }
+
+    return KBUILD_OK;
+}
+
+/**
+  * Hands the action of job to its executor, which runs it wherever it runs
+  * compiles. The scheduler waits for the descriptor it gets back.
+  */
+static KbuildError kbuild_job_submit(KbuildJob *job) {
+    KbuildAction *action = job->action;
+    KbuildError error = action->executor->submit(action->executor, action);
+    if (error != KBUILD_OK) {
+        KBUILD_LOG_ERRORF(error, "Could not submit %s\n", job->description);
+        return error;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = job;
+    epoll_ctl(kbuild_scheduler.epoll_fd, EPOLL_CTL_ADD, action->fd, &event);
+
+    kbuild_scheduler.running++;
+
+    return KBUILD_OK;
+}
+
+/**
+  * Anonymous file in memory holding the output of a preprocessing stage
+  */
+static int kbuild_create_memory_file() {
+#ifdef SYS_memfd_create
+    // MFD_CLOEXEC, without requiring _GNU_SOURCE for the header that names it
+    int fd = syscall(SYS_memfd_create, KBUILD_PREPROCESSED_FILE_NAME, 1U);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+
+    char path[] = "/tmp/" KBUILD_PREPROCESSED_FILE_NAME "-XXXXXX";
+    int tmp_fd = mkstemp(path);
+    if (tmp_fd >= 0) {
+        unlink(path);
+        fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    return tmp_fd;
+}
+
+/**
+  * Preprocessed jobs waiting for the compile stage keep their preprocessing
+  * slot, so at most max_preprocess_jobs preprocessed sources are held at once
+  */
+static int kbuild_job_is_pipelined(const KbuildJob *job) {
+    return job->compile_command != NULL || job->compile_argv != NULL;
+}
+
+static int kbuild_job_has_slot(const KbuildJob *job) {
+    if (kbuild_job_is_pipelined(job)) {
+        return kbuild_scheduler.running_preprocess + kbuild_scheduler.ready->len < kbuild_scheduler.max_preprocess_jobs;
+    }
+
+    return kbuild_scheduler.running < kbuild_scheduler.max_jobs;
+}
+
+/**
+  * Moves preprocessed jobs on to the compile stage while there are free slots
+  * After a failure in fail fast mode they are cancelled instead.
+  */
+static void kbuild_scheduler_start_ready() {
+    KBUILD_DYNARR(kbuild_job_ptr_t) *ready = kbuild_scheduler.ready;
+    if (ready == NULL) {
+        return;
+    }
+
+    int handled = 0;
+    while (handled < ready->len) {
+        KbuildJob *job = ready->buffer[handled];
+        int stopping = job->cancelled || (kbuild_scheduler.error != KBUILD_OK && !kbuild_scheduler_keeps_going());
+
+        if (!stopping && kbuild_scheduler.running >= kbuild_scheduler.max_jobs) {
+            break;
+        }
+        handled++;
+
+        if (!stopping) {
+            free(job->argv);
+            job->argv = job->compile_argv;
+            job->compile_argv = NULL;
+
+            lseek(job->preprocessed_fd, 0, SEEK_SET);
+            KbuildError error = kbuild_job_spawn(job, job->compile_command, job->preprocessed_fd, -1);
+
+            close(job->preprocessed_fd);
+            job->preprocessed_fd = -1;
+            free(job->compile_command);
+            job->compile_command = NULL;
+
+            if (error == KBUILD_OK) {
+                continue;
+            }
+
+            kbuild_string_builder_append(job->output, "Could not start the compile stage\n");
+            job->status = 1;
+        } else {
+            job->cancelled = 1;
+        }
+
+        job->finished = 1;
+        kbuild_job_complete(job);
+    }
+
+    for (int i = handled; i < ready->len; i++) {
+        ready->buffer[i - handled] = ready->buffer[i];
+    }
+    ready->len -= handled;
+}
+
+/**
+  * Hands job over to the scheduler. The flush sequence is only taken here,
+  * a job dropped before it gets this far would leave a gap that ordered
+  * output waits on forever.
+  */
+static void kbuild_scheduler_push_job(KbuildJob *job) {
+    job->sequence = kbuild_scheduler.next_sequence++;
+    KBUILD_DYNARR_PUSH_BACK(kbuild_scheduler.jobs, job);
+}
+
+/**
+  * Starts job as soon as there is a free slot
+  * In fail fast mode no new job is started after a failure, job is freed and the error returned
+  */
+static KbuildError kbuild_job_start(KbuildJob *job, const char *cmd) {
+    kbuild_scheduler_check_interrupt();
+
+    while (kbuild_scheduler.error == KBUILD_OK || kbuild_scheduler_keeps_going()) {
+        if (kbuild_job_has_slot(job)) {
+            break;
+        }
+
+        kbuild_scheduler_poll();
+    }
+
+    if (kbuild_scheduler.error != KBUILD_OK && !kbuild_scheduler_keeps_going()) {
+        kbuild_free_job(job);
+        return kbuild_scheduler.error;
+    }
+
+    // The first stage of a pipelined compile writes the preprocessed source to memory
+    int stdout_fd = -1;
+    if (kbuild_job_is_pipelined(job)) {
+        job->preprocessed_fd = kbuild_create_memory_file();
+        if (job->preprocessed_fd < 0) {
+            KBUILD_LOG_ERRORF(KBUILD_ERROR_SPAWNING, "Could not create a file for the preprocessed %s: %s\n", job->description, strerror(errno));
+            kbuild_free_job(job);
+            kbuild_scheduler_fail(KBUILD_ERROR_SPAWNING);
+            return KBUILD_ERROR_SPAWNING;
+        }
+
+        job->preprocessing = 1;
+        stdout_fd = job->preprocessed_fd;
+    }
+
+    KbuildError error = job->action != NULL ? kbuild_job_submit(job) : kbuild_job_spawn(job, cmd, -1, stdout_fd);
+    if (error != KBUILD_OK) {
+        kbuild_free_job(job);
+        kbuild_scheduler_fail(error);
+        return error;
+    }
+
+    kbuild_scheduler_push_job(job);
+
+    return KBUILD_OK;
+}
+
+/**
+  * Queues the saved output of a job that did not have to run again
+  */
+static void kbuild_job_replay(const char *output_path) {
+    char *log_path = kbuild_output_sidecar_path(output_path, KBUILD_LOG_EXTENSION);
+    FILE *log = fopen(log_path, "rb");
+    free(log_path);
+
+    if (log == NULL) {
+        return;
+    }
+
+    KbuildJob *job = kbuild_create_job(output_path, KBUILD_ERROR_COMPILING);
+    char chunk[KBUILD_JOB_READ_CHUNK_SIZE + 1];
+    size_t bytes_read;
+
+    while ((bytes_read = fread(chunk, 1, KBUILD_JOB_READ_CHUNK_SIZE, log)) > 0) {
+        chunk[bytes_read] = '\0';
+        kbuild_string_builder_appendn(job->output, chunk, bytes_read);
+    }
+    fclose(log);
+
+    job->finished = 1;
+    kbuild_scheduler_push_job(job);
+    kbuild_scheduler_flush();
+}
+
+KbuildError kbuild_wait_jobs() {
+    if (kbuild_scheduler.jobs == NULL) {
+        return KBUILD_OK;
+    }
+
+    kbuild_scheduler_check_interrupt();
+
+    for (;;) {
+        kbuild_scheduler_start_ready();
+        if (kbuild_scheduler.running == 0 && kbuild_scheduler.running_preprocess == 0) {
+            break;
+        }
+
+        kbuild_scheduler_poll();
+    }
+
+    kbuild_scheduler_flush();
+
+    KbuildError error = kbuild_scheduler.error;
+
+    if (kbuild_scheduler.failures->len > 1) {
+        fprintf(stderr, "%d jobs failed:\n", kbuild_scheduler.failures->len);
+        for (int i = 0; i < kbuild_scheduler.failures->len; i++) {
+            fprintf(stderr, "    %s\n", kbuild_scheduler.failures->buffer[i]);
+        }
+    }
+
+    for (int i = 0; i < kbuild_scheduler.failures->len; i++) {
+        free(kbuild_scheduler.failures->buffer[i]);
+    }
+    kbuild_scheduler.failures->len = 0;
+    kbuild_scheduler.error = KBUILD_OK;
+    kbuild_scheduler.interrupted = 0;
+    kbuild_scheduler_release_signals();
+
+    return error;
+}
+
+/**
+  * Compile command writing the object and the depfile to the given paths,
+  * -MT keeps output_path as the depfile target
+  */
+static char *kbuild_format_compile_command(const KbuildFlagSet *flags, const char *input_path, const char *output_path, const char *object_path, const char *depfile_path) {
+    const char *command_parts[10];
+    command_parts[0] = flags->cc;
+    command_parts[1] = "-c -o";
+    command_parts[2] = object_path;
+    command_parts[3] = input_path;
+    command_parts[4] = flags->cflags;
+    command_parts[5] = "-MMD -MF";
+    command_parts[6] = depfile_path;
+    command_parts[7] = "-MT";
+    command_parts[8] = output_path;
+
+    // The tracer writes the depfile instead
+    return kbuild_join_separator(command_parts, kbuild_hermetic ? 5 : 9, " ");
+}
+
+static char *kbuild_compile_command(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    char *tmp_depfile_path = kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION);
+    char *tmp_output_path = kbuild_output_sidecar_path(output_path, KBUILD_TMP_EXTENSION);
+
+    char *cmd = kbuild_format_compile_command(flags, input_path, output_path, tmp_output_path, tmp_depfile_path);
+    free(depfile_path);
+    free(tmp_depfile_path);
+    free(tmp_output_path);
+
+    return cmd;
+}
+
+/**
+  * The command as tools reading compile_commands.json should see it, with
+  * the final paths instead of the temporary ones the job writes to
+  */
+static char *kbuild_compile_db_command(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    char *cmd = kbuild_format_compile_command(flags, input_path, output_path, output_path, depfile_path);
+    free(depfile_path);
+
+    return cmd;
+}
+
+/**
+  * First stage of a pipelined compile, it writes the depfile and sends the
+  * preprocessed source to stdout
+  */
+static char *kbuild_preprocess_command(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    char *tmp_depfile_path = kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION);
+
+    const char *command_parts[8];
+    command_parts[0] = flags->cc;
+    command_parts[1] = "-E";
+    command_parts[2] = input_path;
+    command_parts[3] = flags->cflags;
+    command_parts[4] = "-MMD -MF";
+    command_parts[5] = tmp_depfile_path;
+    command_parts[6] = "-MT";
+    command_parts[7] = output_path;
+
+    char *cmd = kbuild_join_separator(command_parts, kbuild_hermetic ? 4 : 8, " ");
+    free(depfile_path);
+    free(tmp_depfile_path);
+
+    return cmd;
+}
+
+/**
+  * Second stage of a pipelined compile, reading the preprocessed source from
+  * stdin. Nothing tells the compiler its language there, it has to be given.
+  */
+static char *kbuild_format_compile_preprocessed_command(const KbuildFlagSet *flags, const char *output_path, const char *language) {
+    char *tmp_output_path = kbuild_output_sidecar_path(output_path, KBUILD_TMP_EXTENSION);
+
+    const char *command_parts[7];
+    command_parts[0] = flags->cc;
+    command_parts[1] = "-c -x";
+    command_parts[2] = language;
+    command_parts[3] = "-o";
+    command_parts[4] = tmp_output_path;
+    command_parts[5] = "-";
+    command_parts[6] = flags->cflags;
+
+    char *cmd = kbuild_join_separator(command_parts, 7, " ");
+    free(tmp_output_path);
+
+    return cmd;
+}
+
+static char *kbuild_compile_preprocessed_command(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    (void)input_path;
+    return kbuild_format_compile_preprocessed_command(flags, output_path, "cpp-output");
+}
+
+static char *kbuild_compile_preprocessed_cxx_command(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    (void)input_path;
+    return kbuild_format_compile_preprocessed_command(flags, output_path, "c++-cpp-output");
+}
+
+/**
+  * Second stage for the source at path, from the extension the driver would
+  * go by. KBUILD_COMMAND_COMPILE when it is neither C nor C++, such a source
+  * is compiled in one go.
+  */
+static KbuildCommandKind kbuild_compile_preprocessed_kind(const char *path) {
+    const char *name = strrchr(path, KBUILD_DIRECTORY_SEPARATOR);
+    const char *extension = strrchr(name != NULL ? name : path, KBUILD_EXTENSION_SEPARATOR);
+    if (extension == NULL) {
+        return KBUILD_COMMAND_COMPILE;
+    }
+    extension++;
+
+    if (strcmp(extension, KBUILD_SOURCE_FILE_EXTENSION) == 0) {
+        return KBUILD_COMMAND_COMPILE_PREPROCESSED;
+    }
+
+    static const char *cxx_extensions[] = { "cc", "cp", "cxx", "cpp", "CPP", "c++", "C" };
+    for (size_t i = 0; i < sizeof(cxx_extensions) / sizeof(cxx_extensions[0]); i++) {
+        if (strcmp(extension, cxx_extensions[i]) == 0) {
+            return KBUILD_COMMAND_COMPILE_PREPROCESSED_CXX;
+        }
+    }
+
+    return KBUILD_COMMAND_COMPILE;
+}
+
+typedef char *(*KbuildCommandBuilder)(const KbuildFlagSet *flags, const char *input_path, const char *output_path);
+
+static const KbuildCommandBuilder kbuild_command_builders[KBUILD_COMMAND_KIND_COUNT] = {
+    kbuild_compile_command,
+    kbuild_preprocess_command,
+    kbuild_compile_preprocessed_command,
+    kbuild_compile_preprocessed_cxx_command,
+};
+
+KBUILD_DYNARR(kbuild_str_t) *kbuild_split_command(const char *cmd) {
+    KBUILD_DYNARR(kbuild_str_t) *args = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    KbuildStringBuilder *arg = kbuild_create_string_builder();
+    const char *p = cmd;
+    int needs_shell = 0;
+
+    while (!needs_shell) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        // ~ and # are special at the start of a word
+        if (*p == '~' || *p == '#') {
+            needs_shell = 1;
+            break;
+        }
+
+        kbuild_string_builder_clear(arg);
+
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && !needs_shell) {
+            if (*p == '\'') {
+                const char *end = strchr(p + 1, '\'');
+                if (end == NULL) {
+                    needs_shell = 1;
+                    break;
+                }
+                kbuild_string_builder_appendn(arg, p + 1, end - p - 1);
+                p = end + 1;
+            } else if (*p == '"') {
+                for (p++; *p != '"'; p++) {
+                    if (*p == '\0' || *p == '$' || *p == '`') {
+                        needs_shell = 1;
+                        break;
+                    }
+                    if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+                        p++;
+                    }
+                    kbuild_string_builder_append_ch(arg, *p);
+                }
+                if (!needs_shell) {
+                    p++;
+                }
+            } else if (*p == '\\') {
+                if (p[1] == '\0') {
+                    needs_shell = 1;
+                    break;
+                }
+                kbuild_string_builder_append_ch(arg, p[1]);
+                p += 2;
+            } else if (strchr("|&;<>()$`*?[", *p) != NULL || (*p == '=' && args->len == 0)) {
+                // An = in the first word makes it a variable assignment
+                needs_shell = 1;
+            } else {
+                kbuild_string_builder_append_ch(arg, *p++);
+            }
+        }
+
+        if (!needs_shell) {
+            KBUILD_DYNARR_PUSH_BACK(args, strndup(arg->buffer, arg->len));
+        }
+    }
+
+    kbuild_free_string_builder(arg);
+
+    if (needs_shell || args->len == 0) {
+        kbuild_free_strs(args);
+        return NULL;
+    }
+
+    return args;
+}
+
+/**
+  * The builders of the string commands run once per flag set, on the slot
+  * markers instead of paths, which gives the same arguments as the shell
+  * would have split
+  */
+static KbuildCommandTemplate *kbuild_create_command_template(const char *cmd) {
+    KbuildCommandTemplate *template = malloc(sizeof(KbuildCommandTemplate));
+    template->args = kbuild_split_command(cmd);
+    template->slot_count = 0;
+
+    for (int i = 0; template->args != NULL && i < template->args->len; i++) {
+        template->slot_count += template->args->buffer[i][0] == KBUILD_COMMAND_SLOT_MARKER;
+    }
+
+    return template;
+}
+
+static void kbuild_free_command_template(KbuildCommandTemplate *template) {
+    if (template != NULL && template->args != NULL) {
+        kbuild_free_strs(template->args);
+    }
+    free(template);
+}
+
+static const KbuildCommandTemplate *kbuild_command_template(const KbuildFlagSet *flags, KbuildCommandKind kind) {
+    int index = kind * 2 + (kbuild_hermetic ? 1 : 0);
+    if (flags->templates[index] != NULL) {
+        return flags->templates[index];
+    }
+
+    char *cmd = kbuild_command_builders[kind](flags, KBUILD_COMMAND_INPUT_SLOT, KBUILD_COMMAND_OUTPUT_SLOT);
+    KbuildCommandTemplate *template = kbuild_create_command_template(cmd);
+    free(cmd);
+
+    // Prepared lazily, the set itself is shared and read only everywhere else
+    ((KbuildFlagSet*)flags)->templates[index] = template;
+
+    return template;
+}
+
+/**
+  * Arguments of one job from template, the ones that are not slots still
+  * point into it. inputs fills the list slot and may be NULL without one.
+  */
+static char **kbuild_fill_command_template(const KbuildCommandTemplate *template, const char *input_path, const char *output_path, KBUILD_DYNARR(kbuild_str_t) *inputs) {
+    int input_len = strlen(input_path);
+    int output_len = strlen(output_path);
+
+    // Room for the pointers, then for the slots with their suffixes
+    int argc = 0;
+    size_t strings_size = 0;
+    for (int i = 0; i < template->args->len; i++) {
+        const char *arg = template->args->buffer[i];
+        if (arg[0] != KBUILD_COMMAND_SLOT_MARKER) {
+            argc++;
+        } else if (arg[1] == 'l') {
+            for (int j = 0; inputs != NULL && j < inputs->len; j++) {
+                strings_size += strlen(inputs->buffer[j]) + 1;
+            }
+            argc += inputs != NULL ? inputs->len : 0;
+        } else {
+            strings_size += (arg[1] == 'i' ? input_len : output_len) + strlen(arg + 2) + 1;
+            argc++;
+        }
+    }
+
+    char **argv = malloc((argc + 1) * sizeof(char*) + strings_size);
+    char *strings = (char*)(argv + argc + 1);
+    int next_arg = 0;
+
+    for (int i = 0; i < template->args->len; i++) {
+        char *arg = template->args->buffer[i];
+        if (arg[0] != KBUILD_COMMAND_SLOT_MARKER) {
+            argv[next_arg++] = arg;
+            continue;
+        }
+
+        if (arg[1] == 'l') {
+            for (int j = 0; inputs != NULL && j < inputs->len; j++) {
+                int len = strlen(inputs->buffer[j]);
+                argv[next_arg++] = strings;
+                memcpy(strings, inputs->buffer[j], len + 1);
+                strings += len + 1;
+            }
+            continue;
+        }
+
+        const char *path = arg[1] == 'i' ? input_path : output_path;
+        int path_len = arg[1] == 'i' ? input_len : output_len;
+        int suffix_len = strlen(arg + 2);
+
+        argv[next_arg++] = strings;
+        memcpy(strings, path, path_len);
+        memcpy(strings + path_len, arg + 2, suffix_len + 1);
+        strings += path_len + suffix_len + 1;
+    }
+    argv[argc] = NULL;
+
+    return argv;
+}
+
+char **kbuild_prepare_command(const KbuildFlagSet *flags, KbuildCommandKind kind, const char *input_path, const char *output_path) {
+    const KbuildCommandTemplate *template = kbuild_command_template(flags, kind);
+    if (template->args == NULL) {
+        return NULL;
+    }
+
+    return kbuild_fill_command_template(template, input_path, output_path, NULL);
+}
+
+/**
+  * Creates the directories leading to path, the last component being a file
+  * Unlike kbuild_mkdir nothing is cached, these directories are short lived.
+  */
+static int kbuild_mkdir_parents(const char *path) {
+    char tmp[KBUILD_PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s", path);
+    if (len < 0 || len >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == KBUILD_DIRECTORY_SEPARATOR) {
+            *p = '\0';
+            if (mkdir(tmp, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = KBUILD_DIRECTORY_SEPARATOR;
+        }
+    }
+
+    return 0;
+}
+
+static void kbuild_remove_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        unlink(path);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        const char *child_parts[2];
+        child_parts[0] = path;
+        child_parts[1] = entry->d_name;
+        char *child = kbuild_join_paths(child_parts, 2);
+
+        struct stat child_stat;
+        if (lstat(child, &child_stat) == 0 && S_ISDIR(child_stat.st_mode)) {
+            kbuild_remove_tree(child);
+        } else {
+            unlink(child);
+        }
+
+        free(child);
+    }
+
+    closedir(d);
+    rmdir(path);
+}
+
+static int kbuild_copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    char chunk[KBUILD_COPY_CHUNK_SIZE];
+    ssize_t bytes_read;
+    int result = 0;
+
+    while (result == 0 && (bytes_read = read(in, chunk, sizeof(chunk))) > 0) {
+        for (ssize_t written = 0; written < bytes_read;) {
+            ssize_t n = write(out, chunk + written, bytes_read - written);
+            if (n < 0) {
+                result = -1;
+                break;
+            }
+            written += n;
+        }
+    }
+
+    if (bytes_read < 0) {
+        result = -1;
+    }
+
+    close(in);
+    if (close(out) != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+/**
+  * Scans path for #include lines and adds the project files they name to
+  * seen, looking next to path for quoted includes and then in search_dirs
+  */
+static void kbuild_scan_includes(const char *path, KBUILD_DYNARR(kbuild_str_t) *search_dirs, const char *cwd, KbuildInternTable *seen) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    const char *dir_end = strrchr(path, KBUILD_DIRECTORY_SEPARATOR);
+    char *dir_path = strndup(path, dir_end - path);
+    char line[4096];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p++ != '#') {
+            continue;
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (strncmp(p, "include", 7) != 0) {
+            continue;
+        }
+        p += 7;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        char close_ch = *p == '"' ? '"' : *p == '<' ? '>' : '\0';
+        char *name_end = close_ch == '\0' ? NULL : strchr(p + 1, close_ch);
+        if (name_end == NULL) {
+            continue;
+        }
+        *name_end = '\0';
+
+        // The source directory comes first in search_dirs, it is not searched for <> includes
+        for (int i = close_ch == '"' ? -1 : 1; i < search_dirs->len; i++) {
+            const char *include_parts[2];
+            include_parts[0] = i < 0 ? dir_path : search_dirs->buffer[i];
+            include_parts[1] = p + 1;
+            char *include_path = kbuild_join_paths(include_parts, 2);
+            char *real_include_path = realpath(include_path, NULL);
+            free(include_path);
+
+            if (real_include_path == NULL || kbuild_is_dir(real_include_path)) {
+                free(real_include_path);
+                continue;
+            }
+
+            // Headers outside the project come with the toolchain
+            if (kbuild_path_is_under(real_include_path, cwd)) {
+                kbuild_intern(seen, real_include_path);
+            }
+            free(real_include_path);
+            break;
+        }
+    }
+
+    free(dir_path);
+    fclose(file);
+}
+
+/**
+  * Adds the files a compile reads to the inputs of action
+  * They are found by following the #include lines from the source, which
+  * misses includes named by macros, so the prerequisites of the previous
+  * depfile are added too. Project files are listed relative to the working
+  * directory, the others by their absolute path.
+  */
+static void kbuild_add_compile_inputs(KbuildAction *action, const KbuildFlagSet *flags, const char *input_path, const char *output_path) {
+    char cwd[KBUILD_PATH_MAX];
+    char *real_source_path = realpath(input_path, NULL);
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL || real_source_path == NULL) {
+        KBUILD_DYNARR_PUSH_BACK(action->inputs, strdup(input_path));
+        free(real_source_path);
+        return;
+    }
+
+    KBUILD_DYNARR(kbuild_str_t) *search_dirs = kbuild_declared_input_dirs(flags, real_source_path);
+    KbuildInternTable *seen = kbuild_create_intern_table();
+    kbuild_intern(seen, real_source_path);
+
+    // Files of -include
+    for (int i = 1; i < search_dirs->len; i++) {
+        if (!kbuild_is_dir(search_dirs->buffer[i])) {
+            kbuild_intern(seen, search_dirs->buffer[i]);
+        }
+    }
+
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    KBUILD_DYNARR(kbuild_str_t) *previous_dependencies = kbuild_parse_depfile(depfile_path);
+    if (previous_dependencies != NULL) {
+        for (int i = 0; i < previous_dependencies->len; i++) {
+            char *real_path = realpath(previous_dependencies->buffer[i], NULL);
+            if (real_path != NULL) {
+                kbuild_intern(seen, real_path);
+                free(real_path);
+            }
+        }
+        kbuild_free_strs(previous_dependencies);
+    }
+    free(depfile_path);
+
+    // seen grows while it is scanned, every file is scanned once
+    for (int i = 0; i < seen->strs->len; i++) {
+        if (kbuild_path_is_under(seen->strs->buffer[i], cwd)) {
+            kbuild_scan_includes(seen->strs->buffer[i], search_dirs, cwd, seen);
+        }
+    }
+
+    int cwd_len = strlen(cwd);
+    for (int i = 0; i < seen->strs->len; i++) {
+        const char *real_path = seen->strs->buffer[i];
+        KBUILD_DYNARR_PUSH_BACK(action->inputs, strdup(kbuild_path_is_under(real_path, cwd) ? real_path + cwd_len + 1 : real_path));
+    }
+
+    kbuild_free_intern_table(seen);
+    kbuild_free_strs(search_dirs);
+    free(real_source_path);
+}
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char block[KBUILD_SHA256_BLOCK_SIZE];
+    int block_len;
+} KbuildSha256;
+
+static const uint32_t kbuild_sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define KBUILD_ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void kbuild_sha256_init(KbuildSha256 *sha) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial_state, sizeof(initial_state));
+    sha->len = 0;
+    sha->block_len = 0;
+}
+
+static void kbuild_sha256_compress(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = KBUILD_ROTR32(w[i - 15], 7) ^ KBUILD_ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = KBUILD_ROTR32(w[i - 2], 17) ^ KBUILD_ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = KBUILD_ROTR32(e, 6) ^ KBUILD_ROTR32(e, 11) ^ KBUILD_ROTR32(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + kbuild_sha256_round_constants[i] + w[i];
+        uint32_t s0 = KBUILD_ROTR32(a, 2) ^ KBUILD_ROTR32(a, 13) ^ KBUILD_ROTR32(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void kbuild_sha256_update(KbuildSha256 *sha, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    sha->len += len;
+
+    while (len > 0) {
+        size_t count = KBUILD_SHA256_BLOCK_SIZE - sha->block_len;
+        if (count > len) {
+            count = len;
+        }
+
+        memcpy(sha->block + sha->block_len, bytes, count);
+        sha->block_len += count;
+        bytes += count;
+        len -= count;
+
+        if (sha->block_len == KBUILD_SHA256_BLOCK_SIZE) {
+            kbuild_sha256_compress(sha->state, sha->block);
+            sha->block_len = 0;
+        }
+    }
+}
+
+/**
+  * Writes the digest as 64 lowercase hex digits and a terminator
+  */
+static void kbuild_sha256_final_hex(KbuildSha256 *sha, char *hex) {
+    uint64_t bit_len = sha->len * 8;
+
+    // A one bit, zeros up to the last 8 bytes of a block, then the length
+    unsigned char padding[KBUILD_SHA256_BLOCK_SIZE + 8] = { 0x80 };
+    int padding_len = (sha->block_len < 56 ? 56 : 120) - sha->block_len;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_len + i] = bit_len >> (56 - i * 8);
+    }
+    kbuild_sha256_update(sha, padding, padding_len + 8);
+
+    for (int i = 0; i < KBUILD_SHA256_DIGEST_SIZE; i++) {
+        unsigned char byte = sha->state[i / 4] >> (24 - (i % 4) * 8);
+        snprintf(hex + i * 2, 3, "%02x", byte);
+    }
+}
+
+/**
+  * Digest of a file, valid while its mtime and size stay the same
+  */
+typedef struct {
+    struct timespec mtime;
+    long long size;
+    char hex[KBUILD_SHA256_DIGEST_SIZE * 2 + 1];
+} KbuildFileDigest;
+
+KBUILD_DECLARE_HASHMAP(kbuild_str_to_digest, const char*, KbuildFileDigest);
+KBUILD_DEFINE_HASHMAP(kbuild_str_to_digest, const char*, KbuildFileDigest, kbuild_hash_string, kbuild_str_eq);
+
+typedef struct {
+    char *blobs_path;
+    char *exec_path;
+    int next_action;
+    int blobs_uploaded;
+    int blobs_reused;
+    long long bytes_uploaded;
+    // Inputs hashed by an earlier action, the outputs are hashed once anyway
+    KBUILD_HASHMAP(kbuild_str_to_digest) *digests;
+    int digests_reused;
+} KbuildLocalExecutor;
+
+/**
+  * A submitted action of the local executor, running in its own directory
+  * with the output going to a file in memory
+  */
+typedef struct {
+    char *work_dir;
+    pid_t pid;
+    int output_fd;
+} KbuildLocalAction;
+
+static int kbuild_hash_file(const char *path, char *hex) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    KbuildSha256 sha;
+    kbuild_sha256_init(&sha);
+
+    char chunk[KBUILD_COPY_CHUNK_SIZE];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, chunk, sizeof(chunk))) > 0) {
+        kbuild_sha256_update(&sha, chunk, bytes_read);
+    }
+    close(fd);
+
+    if (bytes_read < 0) {
+        return -1;
+    }
+
+    kbuild_sha256_final_hex(&sha, hex);
+
+    return 0;
+}
+
+/**
+  * Stores the contents of path as a blob named after their SHA-256, unless
+  * an identical blob is already there. A reused blob is touched, so pruning
+  * the least recently modified blobs keeps the ones still in use.
+  */
+static KbuildError kbuild_local_executor_put(KbuildLocalExecutor *local, const char *path, int cache_digest, char *blob_path, int blob_path_size) {
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0) {
+        return KBUILD_ERROR_FILE_NOT_FOUND;
+    }
+
+    KbuildFileDigest digest;
+    int slot = cache_digest ? KBUILD_HASHMAP_FIND(kbuild_str_to_digest, local->digests, path) : -1;
+    const KbuildFileDigest *cached = slot >= 0 ? &local->digests->values[slot] : NULL;
+
+    if (cached != NULL && cached->size == path_stat.st_size && cached->mtime.tv_sec == path_stat.st_mtim.tv_sec && cached->mtime.tv_nsec == path_stat.st_mtim.tv_nsec) {
+        digest = *cached;
+        local->digests_reused++;
+    } else {
+        if (kbuild_hash_file(path, digest.hex) != 0) {
+            return KBUILD_ERROR_FILE_NOT_FOUND;
+        }
+        digest.mtime = path_stat.st_mtim;
+        digest.size = path_stat.st_size;
+
+        if (cached != NULL) {
+            local->digests->values[slot] = digest;
+        } else if (cache_digest) {
+            KBUILD_HASHMAP_PUT(kbuild_str_to_digest, local->digests, strdup(path), digest);
+        }
+    }
+
+    snprintf(blob_path, blob_path_size, "%s%c%s", local->blobs_path, KBUILD_DIRECTORY_SEPARATOR, digest.hex);
+
+    if (utimensat(AT_FDCWD, blob_path, NULL, 0) == 0) {
+        local->blobs_reused++;
+        return KBUILD_OK;
+    }
+
+    char *tmp_blob_path = kbuild_output_sidecar_path(blob_path, KBUILD_TMP_EXTENSION);
+    if (kbuild_copy_file(path, tmp_blob_path) != 0 || rename(tmp_blob_path, blob_path) != 0) {
+        unlink(tmp_blob_path);
+        free(tmp_blob_path);
+        return KBUILD_ERROR_WRITING_FILE;
+    }
+    free(tmp_blob_path);
+
+    local->blobs_uploaded++;
+    local->bytes_uploaded += digest.size;
+
+    return KBUILD_OK;
+}
+
+/**
+  * Forks the command of action in its working directory. The write end of
+  * the returned pipe is only held by the command and whatever it spawns, so
+  * the read end becomes readable once they are all done.
+  */
+static KbuildError kbuild_local_executor_start(KbuildAction *action, KbuildLocalAction *run) {
+    // Split before forking, the child only execs
+    KBUILD_DYNARR(kbuild_str_t) *args = kbuild_split_command(action->command);
+    if (args != NULL) {
+        KBUILD_DYNARR_PUSH_BACK(args, NULL);
+    }
+
+    int done_fds[2];
+    run->output_fd = kbuild_create_memory_file();
+    if (run->output_fd < 0 || pipe(done_fds) != 0) {
+        kbuild_free_strs(args);
+        return KBUILD_ERROR_SPAWNING;
+    }
+
+    fcntl(done_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(done_fds[1], F_SETFD, FD_CLOEXEC);
+
+    run->pid = fork();
+    if (run->pid == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        dup2(run->output_fd, STDOUT_FILENO);
+        dup2(run->output_fd, STDERR_FILENO);
+        fcntl(done_fds[1], F_SETFD, 0);
+
+        if (chdir(run->work_dir) != 0) {
+            fprintf(stderr, "Could not enter %s: %s\n", run->work_dir, strerror(errno));
+            _exit(127);
+        }
+
+        for (int i = 0; i < action->env->len; i++) {
+            putenv(action->env->buffer[i]);
+        }
+
+        if (args != NULL) {
+            execvp(args->buffer[0], args->buffer);
+            fprintf(stderr, "Could not run %s: %s\n", args->buffer[0], strerror(errno));
+        } else {
+            execl("/bin/sh", "sh", "-c", action->command, (char*)NULL);
+        }
+        _exit(127);
+    }
+
+    kbuild_free_strs(args);
+    close(done_fds[1]);
+
+    if (run->pid < 0) {
+        close(done_fds[0]);
+        return KBUILD_ERROR_SPAWNING;
+    }
+
+    // Set from both sides, cancel must reach the group as soon as fork returns
+    setpgid(run->pid, run->pid);
+    action->fd = done_fds[0];
+
+    return KBUILD_OK;
+}
+
+static void kbuild_local_executor_release(KbuildAction *action) {
+    KbuildLocalAction *run = action->data;
+
+    if (run->output_fd >= 0) {
+        close(run->output_fd);
+    }
+    kbuild_remove_tree(run->work_dir);
+    free(run->work_dir);
+    free(run);
+    action->data = NULL;
+}
+
+static KbuildError kbuild_local_executor_submit(KbuildExecutor *executor, KbuildAction *action) {
+    KbuildLocalExecutor *local = executor->data;
+
+    char work_dir[KBUILD_PATH_MAX];
+    snprintf(work_dir, sizeof(work_dir), "%s%c%d-%d", local->exec_path, KBUILD_DIRECTORY_SEPARATOR, (int)getpid(), local->next_action++);
+    if (mkdir(work_dir, KBUILD_DIR_MODE) != 0) {
+        return KBUILD_ERROR_EXECUTOR;
+    }
+
+    for (int i = 0; i < action->inputs->len; i++) {
+        const char *input = action->inputs->buffer[i];
+        if (input[0] == KBUILD_DIRECTORY_SEPARATOR) {
+            continue;
+        }
+
+        char blob_path[KBUILD_PATH_MAX];
+        KbuildError error = kbuild_local_executor_put(local, input, 1, blob_path, sizeof(blob_path));
+
+        const char *staged_parts[2];
+        staged_parts[0] = work_dir;
+        staged_parts[1] = input;
+        char *staged_path = kbuild_join_paths(staged_parts, 2);
+
+        // Inputs are only read, the blob itself can be linked in
+        if (error == KBUILD_OK && (kbuild_mkdir_parents(staged_path) != 0 || (link(blob_path, staged_path) != 0 && kbuild_copy_file(blob_path, staged_path) != 0))) {
+            error = KBUILD_ERROR_EXECUTOR;
+        }
+        free(staged_path);
+
+        if (error != KBUILD_OK) {
+            KBUILD_LOG_ERRORF(error, "Could not upload %s\n", input);
+            kbuild_remove_tree(work_dir);
+            return error;
+        }
+    }
+
+    for (int i = 0; i < action->outputs->len; i++) {
+        const char *output = action->outputs->buffer[i];
+        if (output[0] == KBUILD_DIRECTORY_SEPARATOR) {
+            continue;
+        }
+
+        const char *staged_parts[2];
+        staged_parts[0] = work_dir;
+        staged_parts[1] = output;
+        char *staged_path = kbuild_join_paths(staged_parts, 2);
+        int result = kbuild_mkdir_parents(staged_path);
+        free(staged_path);
+
+        if (result != 0) {
+            kbuild_remove_tree(work_dir);
+            return KBUILD_ERROR_EXECUTOR;
+        }
+    }
+
+    KbuildLocalAction *run = malloc(sizeof(KbuildLocalAction));
+    run->work_dir = strdup(work_dir);
+    run->pid = -1;
+    run->output_fd = -1;
+    action->data = run;
+
+    KbuildError error = kbuild_local_executor_start(action, run);
+    if (error != KBUILD_OK) {
+        KBUILD_LOG_ERRORF(error, "Could not run %s: %s\n", action->command, strerror(errno));
+        kbuild_local_executor_release(action);
+    }
+
+    return error;
+}
+
+static void kbuild_local_executor_cancel(KbuildExecutor *executor, KbuildAction *action) {
+    (void)executor;
+    KbuildLocalAction *run = action->data;
+    kill(-run->pid, SIGTERM);
+}
+
+static KbuildError kbuild_local_executor_collect(KbuildExecutor *executor, KbuildAction *action, int *status, struct rusage *usage, KbuildStringBuilder *output) {
+    KbuildLocalExecutor *local = executor->data;
+    KbuildLocalAction *run = action->data;
+    KbuildError error = KBUILD_OK;
+
+    close(action->fd);
+    action->fd = -1;
+
+    // The pipe only closes when the command exits, so this does not wait for long
+    int wait_status;
+    pid_t pid;
+    while ((pid = wait4(run->pid, &wait_status, 0, usage)) < 0 && errno == EINTR);
+
+    if (pid < 0) {
+        *status = 1;
+    } else if (WIFEXITED(wait_status)) {
+        *status = WEXITSTATUS(wait_status);
+    } else {
+        *status = 128 + WTERMSIG(wait_status);
+    }
+
+    char chunk[KBUILD_JOB_READ_CHUNK_SIZE + 1];
+    ssize_t bytes_read;
+    lseek(run->output_fd, 0, SEEK_SET);
+    while ((bytes_read = read(run->output_fd, chunk, KBUILD_JOB_READ_CHUNK_SIZE)) > 0) {
+        chunk[bytes_read] = '\0';
+        kbuild_string_builder_appendn(output, chunk, bytes_read);
+    }
+
+    for (int i = 0; *status == 0 && i < action->outputs->len; i++) {
+        const char *output = action->outputs->buffer[i];
+        if (output[0] == KBUILD_DIRECTORY_SEPARATOR) {
+            continue;
+        }
+
+        const char *produced_parts[2];
+        produced_parts[0] = run->work_dir;
+        produced_parts[1] = output;
+        char *produced_path = kbuild_join_paths(produced_parts, 2);
+
+        // Not every output is produced, a missing object fails when it is moved into place
+        char blob_path[KBUILD_PATH_MAX];
+        if (access(produced_path, F_OK) == 0) {
+            if (kbuild_local_executor_put(local, produced_path, 0, blob_path, sizeof(blob_path)) != KBUILD_OK || kbuild_copy_file(blob_path, output) != 0) {
+                KBUILD_LOG_ERRORF(KBUILD_ERROR_EXECUTOR, "Could not download %s\n", output);
+                error = KBUILD_ERROR_EXECUTOR;
+            }
+        }
+
+        free(produced_path);
+    }
+
+    kbuild_local_executor_release(action);
+
+    return error;
+}
+
+static void kbuild_local_executor_free(KbuildExecutor *executor) {
+    KbuildLocalExecutor *local = executor->data;
+
+    kbuild_prune_dir(local->blobs_path, KBUILD_LOCAL_EXECUTOR_MAX_SIZE);
+
+    for (int i = 0; i < local->digests->cap; i++) {
+        if (KBUILD_HASHMAP_SLOT_USED(local->digests, i)) {
+            free((char*)local->digests->keys[i]);
+        }
+    }
+    KBUILD_FREE_HASHMAP(kbuild_str_to_digest, local->digests);
+
+    free(local->blobs_path);
+    free(local->exec_path);
+    free(local);
+    free(executor);
+}
+
+KbuildExecutor *kbuild_create_local_executor(const char *root_path) {
+    KbuildLocalExecutor *local = malloc(sizeof(KbuildLocalExecutor));
+
+    const char *blobs_parts[2];
+    blobs_parts[0] = root_path;
+    blobs_parts[1] = KBUILD_LOCAL_EXECUTOR_BLOBS_DIR_NAME;
+    local->blobs_path = kbuild_join_paths(blobs_parts, 2);
+
+    const char *exec_parts[2];
+    exec_parts[0] = root_path;
+    exec_parts[1] = KBUILD_LOCAL_EXECUTOR_EXEC_DIR_NAME;
+    local->exec_path = kbuild_join_paths(exec_parts, 2);
+
+    local->next_action = 0;
+    local->blobs_uploaded = 0;
+    local->blobs_reused = 0;
+    local->bytes_uploaded = 0;
+    local->digests = KBUILD_CREATE_HASHMAP(kbuild_str_to_digest);
+    local->digests_reused = 0;
+
+    // Actions never collected, from an interrupted build
+    kbuild_remove_tree(local->exec_path);
+    kbuild_mkdir(local->blobs_path);
+    mkdir(local->exec_path, KBUILD_DIR_MODE);
+
+    KbuildExecutor *executor = malloc(sizeof(KbuildExecutor));
+    executor->submit = kbuild_local_executor_submit;
+    executor->collect = kbuild_local_executor_collect;
+    executor->cancel = kbuild_local_executor_cancel;
+    executor->free = kbuild_local_executor_free;
+    executor->data = local;
+
+    return executor;
+}
+
+/**
+  * Builds the tracer library into dir_path, unless it is already there
+  * The name carries the hash of the source, so a newer kbuild builds its own.
+  */
+static KbuildError kbuild_prepare_tracer(const char *dir_path) {
+    if (kbuild_tracer_path != NULL) {
+        return KBUILD_OK;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%016llx.so", KBUILD_TRACER_NAME, (unsigned long long)kbuild_hash_string(KBUILD_TRACER_SOURCE));
+
+    const char *path_parts[2];
+    path_parts[0] = dir_path;
+    path_parts[1] = name;
+    char *path = kbuild_join_paths(path_parts, 2);
+
+    if (access(path, R_OK) != 0) {
+        kbuild_mkdir(dir_path);
+
+        char *tmp_path = kbuild_output_sidecar_path(path, KBUILD_TMP_EXTENSION);
+        char cmd[KBUILD_MAX_COMMAND_SIZE];
+        snprintf(cmd, sizeof(cmd), "%s -shared -fPIC -O2 -x c - -o %s -ldl", KBUILD_CC, tmp_path);
+
+        FILE *compiler = popen(cmd, "w");
+        int status = -1;
+        if (compiler != NULL) {
+            fputs(KBUILD_TRACER_SOURCE, compiler);
+            status = pclose(compiler);
+        }
+
+        if (status != 0 || rename(tmp_path, path) != 0) {
+            KBUILD_LOG_ERRORF(KBUILD_ERROR_COMPILING, "Could not build the file access tracer %s\n", path);
+            unlink(tmp_path);
+            free(tmp_path);
+            free(path);
+            return KBUILD_ERROR_COMPILING;
+        }
+
+        free(tmp_path);
+    }
+
+    // LD_PRELOAD has to find it from wherever the compiler runs
+    kbuild_tracer_path = realpath(path, NULL);
+    free(path);
+
+    return kbuild_tracer_path != NULL ? KBUILD_OK : KBUILD_ERROR_COMPILING;
+}
+
+static KbuildError kbuild_compile_with_flags(const KbuildFlagSet *flags, const char* input_path, const char*output_path) {
+    KbuildError error = kbuild_scheduler_init();
+    if (error != KBUILD_OK) {
+        return error;
+    }
+
+    KbuildJob *job = kbuild_create_job(input_path, KBUILD_ERROR_COMPILING);
+    job->output_path = strdup(output_path);
+    job->flags = flags;
+
+    if (kbuild_hermetic) {
+        const char *output_dir_end = strrchr(output_path, KBUILD_DIRECTORY_SEPARATOR);
+        char *output_dir = output_dir_end == NULL ? strdup(".") : strndup(output_path, output_dir_end - output_path);
+        error = kbuild_prepare_tracer(output_dir);
+        free(output_dir);
+
+        if (error != KBUILD_OK) {
+            kbuild_free_job(job);
+            return error;
+        }
+
+        job->trace_path = kbuild_output_sidecar_path(output_path, KBUILD_TRACE_EXTENSION);
+        unlink(job->trace_path);
+    }
+
+    // An executor gets the compile as a single action
+    if (kbuild_executor != NULL) {
+        char *cmd = kbuild_compile_command(flags, input_path, output_path);
+        KbuildAction *action = kbuild_create_action(kbuild_executor, cmd);
+        free(cmd);
+        kbuild_add_compile_inputs(action, flags, input_path, output_path);
+
+        char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+        KBUILD_DYNARR_PUSH_BACK(action->outputs, kbuild_output_sidecar_path(output_path, KBUILD_TMP_EXTENSION));
+        KBUILD_DYNARR_PUSH_BACK(action->outputs, kbuild_output_sidecar_path(depfile_path, KBUILD_TMP_EXTENSION));
+        KBUILD_DYNARR_PUSH_BACK(action->outputs, kbuild_output_sidecar_path(output_path, KBUILD_DWO_EXTENSION));
+        if (job->trace_path != NULL) {
+            KBUILD_DYNARR_PUSH_BACK(action->outputs, strdup(job->trace_path));
+            kbuild_add_action_env(action, "LD_PRELOAD", kbuild_tracer_path);
+            kbuild_add_action_env(action, "KBUILD_TRACE_FILE", job->trace_path);
+        }
+        free(depfile_path);
+
+        job->action = action;
+        return kbuild_job_start(job, action->command);
+    }
+
+    KbuildCommandKind compile_kind = KBUILD_COMMAND_COMPILE;
+    if (kbuild_scheduler.max_preprocess_jobs > 0) {
+        compile_kind = kbuild_compile_preprocessed_kind(input_path);
+    }
+
+    int pipelined = compile_kind != KBUILD_COMMAND_COMPILE;
+    KbuildCommandKind kind = pipelined ? KBUILD_COMMAND_PREPROCESS : KBUILD_COMMAND_COMPILE;
+    job->argv = kbuild_prepare_command(flags, kind, input_path, output_path);
+
+    if (pipelined) {
+        job->compile_argv = kbuild_prepare_command(flags, compile_kind, input_path, output_path);
+        if (job->compile_argv == NULL) {
+            job->compile_command = kbuild_command_builders[compile_kind](flags, input_path, output_path);
+        }
+    }
+
+    // Flags only a shell understands
+    char *cmd = NULL;
+    if (job->argv == NULL) {
+        cmd = kbuild_command_builders[kind](flags, input_path, output_path);
+    }
+
+    error = kbuild_job_start(job, cmd);
+    free(cmd);
+
+    return error;
+}
+
+KbuildError kbuild_compile(const char* input_path, const char*output_path) {
+    KbuildError error = kbuild_compile_with_flags(kbuild_resolve_flags(input_path), input_path, output_path);
+    KbuildError jobs_error = kbuild_wait_jobs();
+
+    return error != KBUILD_OK ? error : jobs_error;
+}
+
+/**
+  * Output directory mirroring an input directory during the walk
+  * It is only created once a source file or a subdirectory needs it, relative
+  * to the descriptor of its parent so the path is not resolved again.
+  */
+typedef struct KbuildOutputDir {
+    struct KbuildOutputDir *parent;
+    const char *name;
+    char *path;
+    int created;
+    int fd;
+} KbuildOutputDir;
+
+static int kbuild_output_dir_open(KbuildOutputDir *dir);
+
+static int kbuild_output_dir_create(KbuildOutputDir *dir) {
+    if (dir->created) {
+        return 0;
+    }
+
+    if (dir->parent == NULL || kbuild_dir_cache_contains(dir->path)) {
+        if (kbuild_mkdir(dir->path) != 0) {
+            return -1;
+        }
+    } else {
+        int parent_fd = kbuild_output_dir_open(dir->parent);
+        if (parent_fd < 0) {
+            return -1;
+        }
+
+        if (mkdirat(parent_fd, dir->name, KBUILD_DIR_MODE) != 0 && errno != EEXIST) {
+            return -1;
+        }
+
+        kbuild_dir_cache_add(dir->path);
+    }
+
+    dir->created = 1;
+
+    return 0;
+}
+
+static int kbuild_output_dir_open(KbuildOutputDir *dir) {
+    if (dir->fd >= 0) {
+        return dir->fd;
+    }
+
+    if (kbuild_output_dir_create(dir) != 0) {
+        return -1;
+    }
+
+    if (dir->parent == NULL || dir->parent->fd < 0) {
+        dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    return dir->fd;
+}
+
+/**
+  * A compile found during the walk, it is only started once the whole list
+  * is known so the most expensive ones go first
+  */
+typedef struct {
+    char *input_path;
+    char *output_path;
+    const KbuildFlagSet *flags;
+    // From the previous build, NULL if there was none
+    KBUILD_DYNARR(kbuild_str_t) *dependencies;
+    long long cost;
+} KbuildPendingCompile;
+
+typedef KbuildPendingCompile* kbuild_pending_compile_ptr_t;
+
+KBUILD_DECLARE_DYNARR(kbuild_pending_compile_ptr_t);
+KBUILD_DEFINE_DYNARR(kbuild_pending_compile_ptr_t);
+
+static long long kbuild_file_size(const char *path) {
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0) {
+        return 0;
+    }
+
+    return path_stat.st_size;
+}
+
+static KbuildPendingCompile *kbuild_create_pending_compile(const char *input_path, const char *output_path, const KbuildFlagSet *flags) {
+    KbuildPendingCompile *pending = malloc(sizeof(KbuildPendingCompile));
+    pending->input_path = strdup(input_path);
+    pending->output_path = strdup(output_path);
+    pending->flags = flags;
+
+    char *depfile_path = kbuild_output_sidecar_path(output_path, KBUILD_DEPFILE_EXTENSION);
+    pending->dependencies = kbuild_parse_depfile(depfile_path);
+    free(depfile_path);
+
+    // The bytes the compiler has to read, a rough measure of how long it takes
+    pending->cost = kbuild_file_size(input_path);
+    if (pending->dependencies != NULL) {
+        for (int i = 0; i < pending->dependencies->len; i++) {
+            pending->cost += kbuild_file_size(pending->dependencies->buffer[i]);
+        }
+    }
+
+    return pending;
+}
+
+static void kbuild_free_pending_compile(KbuildPendingCompile *pending) {
+    free(pending->input_path);
+    free(pending->output_path);
+    if (pending->dependencies != NULL) {
+        kbuild_free_strs(pending->dependencies);
+    }
+    free(pending);
+}
+
+static int kbuild_compare_pending_compiles(const void *a, const void *b) {
+    const KbuildPendingCompile *pending_a = *(const KbuildPendingCompile**)a;
+    const KbuildPendingCompile *pending_b = *(const KbuildPendingCompile**)b;
+
+    if (pending_a->cost != pending_b->cost) {
+        return pending_a->cost > pending_b->cost ? -1 : 1;
+    }
+
+    return strcmp(pending_a->input_path, pending_b->input_path);
+}
+
+static void kbuild_prefetch_file(const char *path, KBUILD_HASHSET(kbuild_str_set) *prefetched) {
+    if (KBUILD_HASHSET_CONTAINS(kbuild_str_set, prefetched, path)) {
+        return;
+    }
+
+    KBUILD_HASHSET_ADD(kbuild_str_set, prefetched, path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    // Only queues the reads, the compiler later finds the pages in the cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/**
+  * Starts the compiles, the most expensive first, so a long one does not end
+  * up alone at the end of the build. The inputs of the next compiles are
+  * prefetched just ahead of the jobs, headers shared by several of them once.
+  */
+static KbuildError kbuild_run_pending_compiles(KBUILD_DYNARR(kbuild_pending_compile_ptr_t) *pending) {
+    KbuildError error = kbuild_scheduler_init();
+    if (error != KBUILD_OK) {
+        return error;
+    }
+
+    qsort(pending->buffer, pending->len, sizeof(kbuild_pending_compile_ptr_t), kbuild_compare_pending_compiles);
+
+    // The paths belong to the pending compiles, which outlive the set
+    KBUILD_HASHSET(kbuild_str_set) *prefetched = KBUILD_CREATE_HASHSET(kbuild_str_set);
+    int window = kbuild_scheduler.max_jobs * KBUILD_PREFETCH_WINDOW_FACTOR;
+    int next_prefetch = 0;
+
+    for (int i = 0; i < pending->len && error == KBUILD_OK; i++) {
+        for (; next_prefetch < pending->len && next_prefetch < i + window; next_prefetch++) {
+            KbuildPendingCompile *upcoming = pending->buffer[next_prefetch];
+
+            kbuild_prefetch_file(upcoming->input_path, prefetched);
+            if (upcoming->dependencies != NULL) {
+                for (int j = 0; j < upcoming->dependencies->len; j++) {
+                    kbuild_prefetch_file(upcoming->dependencies->buffer[j], prefetched);
+                }
+            }
+        }
+
+        KbuildPendingCompile *compile = pending->buffer[i];
+        error = kbuild_compile_with_flags(compile->flags, compile->input_path, compile->output_path);
+    }
+
+    KBUILD_FREE_HASHSET(kbuild_str_set, prefetched);
+
+    return error;
+}
+
+static KbuildError kbuild_compile_files_in_dir_recursive(const char* input_path, KbuildOutputDir *output_dir, KbuildCompileDb *db, KBUILD_DYNARR(kbuild_str_t) *output_paths, KBUILD_DYNARR(kbuild_pending_compile_ptr_t) *pending) {
+    KbuildError error = KBUILD_OK;
+
+    KBUILD_FOREACH_FILE_OR_ERROR(input_path, error, {
+        if (file_info.is_dir) {
+            const char *sub_dir_paths_to_join[2];
+            sub_dir_paths_to_join[0] = output_dir->path;
+            sub_dir_paths_to_join[1] = file_info.name;
+
+            KbuildOutputDir sub_dir;
+            sub_dir.parent = output_dir;
+            sub_dir.name = file_info.name;
+            sub_dir.path = kbuild_join_paths(sub_dir_paths_to_join, 2);
+            sub_dir.created = 0;
+            sub_dir.fd = -1;
+
+            error = kbuild_compile_files_in_dir_recursive(file_info.full_path, &sub_dir, db, output_paths, pending);
+
+            if (sub_dir.fd >= 0) {
+                close(sub_dir.fd);
+            }
+            free(sub_dir.path);
+
+            if (error != KBUILD_OK) {
+                break;
+            }
+        } else {
+            KbuildPathInfo *pathinfo = kbuild_pathinfo(file_info.full_path);
+            if (pathinfo == NULL) {
+                KBUILD_LOG_ERRORF(KBUILDER_ERROR_INVALID_PATH, "%s\n", file_info.full_path);
+                error = KBUILDER_ERROR_INVALID_PATH;
+                break;
+            }
+
+            if (strcmp(pathinfo->extension, KBUILD_SOURCE_FILE_EXTENSION) == 0) {
+                const char *output_full_dir_path = output_dir->path;
+
+                // A missing directory makes the compiler report the output path
+                kbuild_output_dir_create(output_dir);
+
+                const char *output_basename_parts[2];
+                output_basename_parts[0] = pathinfo->filename;
+                output_basename_parts[1] = KBUILD_OBJECT_FILE_EXTENSION_WITH_DOT;
+                char *output_basename = kbuild_join(output_basename_parts, 2);
+                
+                const char *output_file_paths_parts[2];
+                output_file_paths_parts[0] = output_full_dir_path;
+                output_file_paths_parts[1] = output_basename;
+                char *output_full_file_path = kbuild_join_paths(output_file_paths_parts, 2);
+
+                const KbuildFlagSet *flags = kbuild_resolve_flags(file_info.full_path);
+
+                if (db != NULL) {
+                    char *cmd = kbuild_compile_db_command(flags, file_info.full_path, output_full_file_path);
+                    kbuild_compile_db_add(db, cmd, file_info.full_path, output_full_file_path);
+                    free(cmd);
+                }
+
+                if (kbuild_needs_compile(file_info.full_path, output_full_file_path, flags)) {
+                    KBUILD_DYNARR_PUSH_BACK(pending, kbuild_create_pending_compile(file_info.full_path, output_full_file_path, flags));
+                } else {
+                    kbuild_job_replay(output_full_file_path);
+                }
+
+                KBUILD_DYNARR_PUSH_BACK(output_paths, output_full_file_path);
+
+                free(output_basename);
+            }
+
+            kbuild_free_pathinfo(pathinfo);
+
+            if (error != KBUILD_OK) {
+                break;
+            }
+        }
+    });
+
+    if (error == KBUILD_ERROR_FILE_NOT_FOUND || error == KBUILD_ERROR_PATH_TOO_BIG) {
+        KBUILD_LOG_ERRORF(error, "%s\n", input_path);
+    }
+
+    return error;
+}
+
+static int kbuild_has_suffix(const char *str, const char *suffix) {
+    int str_len = strlen(str);
+    int suffix_len = strlen(suffix);
+
+    return str_len >= suffix_len && strcmp(str + str_len - suffix_len, suffix) == 0;
+}
+
+void kbuild_sweep_tmp_files(const char *build_path) {
+    KbuildError error = KBUILD_OK;
+
+    KBUILD_FOREACH_FILE_OR_ERROR(build_path, error, {
+        if (file_info.is_dir) {
+            kbuild_sweep_tmp_files(file_info.full_path);
+        } else if (kbuild_has_suffix(file_info.name, KBUILD_TMP_EXTENSION)) {
+            unlink(file_info.full_path);
+        }
+    });
+
+    // A build directory that does not exist yet has nothing to sweep
+    (void)error;
+}
+
+KBUILD_DECLARE_DYNARR(double);
+KBUILD_DEFINE_DYNARR(double);
+
+/**
+  * Translation units as compressed rows: the headers of unit i are
+  * header_ids[offsets[i]] up to header_ids[offsets[i + 1]]
+  */
+typedef struct {
+    KBUILD_DYNARR(int) *offsets;
+    KBUILD_DYNARR(int) *header_ids;
+    KBUILD_DYNARR(double) *costs;
+} KbuildIncludeGraph;
+
+static void kbuild_include_graph_add_units(const char *dir_path, KbuildIncludeGraph *graph, KbuildInternTable *headers) {
+    KbuildError error = KBUILD_OK;
+
+    KBUILD_FOREACH_FILE_OR_ERROR(dir_path, error, {
+        if (file_info.is_dir) {
+            kbuild_include_graph_add_units(file_info.full_path, graph, headers);
+            continue;
+        }
+
+        if (!kbuild_has_suffix(file_info.name, KBUILD_OBJECT_FILE_EXTENSION_WITH_DOT KBUILD_DEPFILE_EXTENSION)) {
+            continue;
+        }
+
+        KBUILD_DYNARR(kbuild_str_t) *dependencies = kbuild_parse_depfile(file_info.full_path);
+        if (dependencies == NULL) {
+            continue;
+        }
+
+        char *object_path = strndup(file_info.full_path, strlen(file_info.full_path) - strlen(KBUILD_DEPFILE_EXTENSION));
+        uint64_t flags_id;
+        double cost = 0;
+        kbuild_read_stamp(object_path, &flags_id, &cost);
+        free(object_path);
+
+        KBUILD_DYNARR_PUSH_BACK(graph->costs, cost);
+
+        // The first prerequisite is the source file itself
+        for (int i = 1; i < dependencies->len; i++) {
+            KBUILD_DYNARR_PUSH_BACK(graph->header_ids, kbuild_intern_path(headers, dependencies->buffer[i]));
+        }
+        KBUILD_DYNARR_PUSH_BACK(graph->offsets, graph->header_ids->len);
+
+        kbuild_free_strs(dependencies);
+    });
+
+    (void)error;
+}
+
+static const KbuildFanoutReport *kbuild_fanout_sort_report = NULL;
+
+static int kbuild_compare_fanout(const void *a, const void *b) {
+    int id_a = *(const int*)a;
+    int id_b = *(const int*)b;
+    const KbuildFanoutReport *report = kbuild_fanout_sort_report;
+
+    if (report->cost_seconds[id_a] != report->cost_seconds[id_b]) {
+        return report->cost_seconds[id_a] > report->cost_seconds[id_b] ? -1 : 1;
+    }
+
+    if (report->dependents[id_a] != report->dependents[id_b]) {
+        return report->dependents[id_a] > report->dependents[id_b] ? -1 : 1;
+    }
+
+    return strcmp(kbuild_interned_string(report->headers, id_a), kbuild_interned_string(report->headers, id_b));
+}
+
+KbuildFanoutReport *kbuild_analyze_fanout(const char *build_path) {
+    assert(build_path != NULL);
+
+    KbuildFanoutReport *report = malloc(sizeof(KbuildFanoutReport));
+    report->headers = kbuild_create_intern_table();
+
+    KbuildIncludeGraph graph;
+    graph.offsets = KBUILD_CREATE_DYNARR(int);
+    graph.header_ids = KBUILD_CREATE_DYNARR(int);
+    graph.costs = KBUILD_CREATE_DYNARR(double);
+    KBUILD_DYNARR_PUSH_BACK(graph.offsets, 0);
+
+    kbuild_include_graph_add_units(build_path, &graph, report->headers);
+
+    int header_count = report->headers->strs->len;
+    report->translation_units = graph.offsets->len - 1;
+    report->dependents = calloc(header_count > 0 ? header_count : 1, sizeof(int));
+    report->cost_seconds = calloc(header_count > 0 ? header_count : 1, sizeof(double));
+    report->ranked = malloc(sizeof(int) * (header_count > 0 ? header_count : 1));
+    report->total_cost_seconds = 0;
+
+    // One pass over the edges, a depfile already lists the headers included indirectly
+    for (int unit = 0; unit < report->translation_units; unit++) {
+        report->total_cost_seconds += graph.costs->buffer[unit];
+
+        for (int edge = graph.offsets->buffer[unit]; edge < graph.offsets->buffer[unit + 1]; edge++) {
+            int header = graph.header_ids->buffer[edge];
+            report->dependents[header]++;
+            report->cost_seconds[header] += graph.costs->buffer[unit];
+        }
+    }
+
+    for (int i = 0; i < header_count; i++) {
+        report->ranked[i] = i;
+    }
+
+    kbuild_fanout_sort_report = report;
+    qsort(report->ranked, header_count, sizeof(int), kbuild_compare_fanout);
+    kbuild_fanout_sort_report = NULL;
+
+    KBUILD_FREE_DYNARR(graph.offsets);
+    KBUILD_FREE_DYNARR(graph.header_ids);
+    KBUILD_FREE_DYNARR(graph.costs);
+
+    return report;
+}
+
+void kbuild_print_fanout_report(const KbuildFanoutReport *report, int top_n) {
+    assert(report != NULL);
+
+    fprintf(stderr, "%10s %8s %6s  %s\n", "cost", "units", "share", "header");
+
+    int header_count = report->headers->strs->len;
+    for (int i = 0; i < header_count && i < top_n; i++) {
+        int header = report->ranked[i];
+        double share = report->translation_units > 0 ? 100.0 * report->dependents[header] / report->translation_units : 0;
+
+        fprintf(stderr, "%9.3fs %8d %5.1f%%  %s\n", report->cost_seconds[header], report->dependents[header], share,
+                kbuild_interned_string(report->headers, header));
+    }
+
+    fprintf(stderr, "%d headers, %d translation units, %.3fs cpu to rebuild everything\n",
+            header_count, report->translation_units, report->total_cost_seconds);
+}
+
+void kbuild_free_fanout_report(KbuildFanoutReport *report) {
+    assert(report != NULL);
+
+    kbuild_free_intern_table(report->headers);
+    free(report->dependents);
+    free(report->cost_seconds);
+    free(report->ranked);
+    free(report);
+}
+
+KBUILD_DYNARR(kbuild_str_t) *kbuild_compile_files_in_dir(const char* input_path, const char* build_path) {
+    int build_path_len = strlen(build_path);
+
+    // length of the build path + separator
+    if ((build_path_len + 1) >= KBUILD_MAX_OUTPUT_FULLPATH_SIZE) {
+        KBUILD_LOG_ERRORF(KBUILD_ERROR_OUTPUT_FILE_PATH_TOO_BIG, "For build path %s\n", build_path);
+        return NULL;
+    }
+
+    KbuildCompileDb *db = NULL;
+    if (kbuild_emit_compile_commands) {
+        kbuild_mkdir(build_path);
+
+        db = kbuild_compile_db_open(build_path);
+        if (db == NULL) {
+            KBUILD_LOG_ERRORF(KBUILD_ERROR_COMPILE_DB, "Could not open the compile database in %s\n", build_path);
+            return NULL;
+        }
+    }
+
+    kbuild_sweep_tmp_files(build_path);
+
+    if (kbuild_hermetic && kbuild_prepare_tracer(build_path) != KBUILD_OK) {
+        if (db != NULL) {
+            kbuild_compile_db_close(db);
+        }
+        return NULL;
+    }
+
+    const char *output_dir_paths_to_join[2];
+    output_dir_paths_to_join[0] = build_path;
+    output_dir_paths_to_join[1] = input_path;
+
+    KbuildOutputDir output_dir = { NULL, NULL, kbuild_join_paths(output_dir_paths_to_join, 2), 0, -1 };
+
+    KBUILD_DYNARR(kbuild_str_t) *output_paths = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    KBUILD_DYNARR(kbuild_pending_compile_ptr_t) *pending = KBUILD_CREATE_DYNARR(kbuild_pending_compile_ptr_t);
+    KbuildError error = kbuild_compile_files_in_dir_recursive(input_path, &output_dir, db, output_paths, pending);
+
+    if (output_dir.fd >= 0) {
+        close(output_dir.fd);
+    }
+    free(output_dir.path);
+
+    if (error == KBUILD_OK) {
+        error = kbuild_run_pending_compiles(pending);
+    }
+
+    if (error != KBUILD_OK && !kbuild_scheduler_keeps_going()) {
+        kbuild_cancel_jobs();
+    }
+
+    KbuildError jobs_error = kbuild_wait_jobs();
+    if (error == KBUILD_OK) {
+        error = jobs_error;
+    }
+
+    for (int i = 0; i < pending->len; i++) {
+        kbuild_free_pending_compile(pending->buffer[i]);
+    }
+    KBUILD_FREE_DYNARR(pending);
+
+    if (db != NULL) {
+        KbuildError db_error = kbuild_compile_db_close(db);
+        if (error == KBUILD_OK) {
+            error = db_error;
+        }
+    }
+
+    if (error != KBUILD_OK) {
+        kbuild_free_strs(output_paths);
+        return NULL;
+    }
+
+    return output_paths;
+}
+
+char *kbuild_find_program(const char *name) {
+    assert(name != NULL);
+
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        return NULL;
+    }
+
+    char candidate[KBUILD_PATH_MAX];
+
+    for (const char *dir = path_env; ; ) {
+        const char *dir_end = strchr(dir, ':');
+        int dir_len = dir_end == NULL ? (int)strlen(dir) : (int)(dir_end - dir);
+
+        // An empty entry is the current directory
+        int len = dir_len == 0
+            ? snprintf(candidate, sizeof(candidate), "%s", name)
+            : snprintf(candidate, sizeof(candidate), "%.*s%c%s", dir_len, dir, KBUILD_DIRECTORY_SEPARATOR, name);
+
+        if (len > 0 && len < (int)sizeof(candidate) && access(candidate, X_OK) == 0 && !kbuild_is_dir(candidate)) {
+            return strdup(candidate);
+        }
+
+        if (dir_end == NULL) {
+            return NULL;
+        }
+
+        dir = dir_end + 1;
+    }
+}
+
+static char *kbuild_linker = NULL;
+static int kbuild_linker_resolved = 0;
+
+void kbuild_set_linker(const char *linker) {
+    free(kbuild_linker);
+    kbuild_linker = linker == NULL ? NULL : strdup(linker);
+    kbuild_linker_resolved = linker != NULL;
+}
+
+/**
+  * Asks the driver to run the linker, older drivers reject -fuse-ld values
+  * they do not know even when the linker is installed
+  */
+static int kbuild_driver_accepts_linker(const char *cc, const char *linker) {
+    char cmd[KBUILD_MAX_COMMAND_SIZE];
+    snprintf(cmd, sizeof(cmd), "%s -fuse-ld=%s -Wl,--version >/dev/null 2>&1", cc, linker);
+
+    return system(cmd) == 0;
+}
+
+/**
+  * Returns the -fuse-ld name, or an empty string for the driver's default
+  * The driver is probed once, the answer holds for the whole build.
+  */
+static const char *kbuild_resolve_linker(const char *cc) {
+    if (kbuild_linker_resolved) {
+        return kbuild_linker;
+    }
+
+    // Fastest first, all of them spread the link over several threads
+    const char *linkers[] = { "mold", "lld", "gold" };
+
+    kbuild_linker = strdup("");
+    for (int i = 0; i < (int)(sizeof(linkers) / sizeof(linkers[0])); i++) {
+        if (kbuild_driver_accepts_linker(cc, linkers[i])) {
+            free(kbuild_linker);
+            kbuild_linker = strdup(linkers[i]);
+            break;
+        }
+    }
+
+    kbuild_linker_resolved = 1;
+
+    return kbuild_linker;
+}
+
+/**
+  * Appends -fuse-ld and the thread count option of the linker, if it has one
+  */
+static void kbuild_append_linker_flags(KbuildStringBuilder *builder, const char *cc, int threads) {
+    const char *linker = kbuild_resolve_linker(cc);
+    if (linker[0] == '\0') {
+        return;
+    }
+
+    kbuild_append_flag(builder, "-fuse-ld=", linker);
+
+    char threads_flag[64];
+    threads_flag[0] = '\0';
+
+    if (strcmp(linker, "mold") == 0) {
+        snprintf(threads_flag, sizeof(threads_flag), "-Wl,--thread-count=%d", threads);
+    } else if (strcmp(linker, "lld") == 0) {
+        snprintf(threads_flag, sizeof(threads_flag), "-Wl,--threads=%d", threads);
+    } else if (strcmp(linker, "gold") == 0) {
+        snprintf(threads_flag, sizeof(threads_flag), "-Wl,--threads,--thread-count=%d", threads);
+    }
+
+    kbuild_append_flag(builder, "", threads_flag);
+}
+
+/**
+  * Appends the LTO options for the link: the number of backend threads and,
+  * where the toolchain has one, the incremental cache
+  */
+static void kbuild_append_lto_flags(KbuildStringBuilder *builder, const char *cc, const char *cache_dir, int threads) {
+    KbuildCompilerInfo info = kbuild_compiler_info(cc);
+    char flag[KBUILD_PATH_MAX + 64];
+
+    if (!info.is_clang) {
+        snprintf(flag, sizeof(flag), "-flto=%d", threads);
+        kbuild_append_flag(builder, "", flag);
+
+        // Incremental LTO only exists since GCC 15
+        if (info.major_version >= 15) {
+            kbuild_append_flag(builder, "-flto-incremental=", cache_dir);
+        }
+
+        return;
+    }
+
+    // lld takes ThinLTO options directly, the other linkers go through the LLVM plugin
+    if (strcmp(kbuild_resolve_linker(cc), "lld") == 0) {
+        snprintf(flag, sizeof(flag), "-Wl,--thinlto-jobs=%d", threads);
+        kbuild_append_flag(builder, "", flag);
+        kbuild_append_flag(builder, "-Wl,--thinlto-cache-dir=", cache_dir);
+        snprintf(flag, sizeof(flag), "-Wl,--thinlto-cache-policy=cache_size_bytes=%lld", kbuild_lto_cache_size);
+        kbuild_append_flag(builder, "", flag);
+    } else {
+        snprintf(flag, sizeof(flag), "-Wl,-plugin-opt=jobs=%d", threads);
+        kbuild_append_flag(builder, "", flag);
+        kbuild_append_flag(builder, "-Wl,-plugin-opt=cache-dir=", cache_dir);
+        snprintf(flag, sizeof(flag), "-Wl,-plugin-opt=cache-policy=cache_size_bytes=%lld", kbuild_lto_cache_size);
+        kbuild_append_flag(builder, "", flag);
+    }
+}
+
+typedef struct {
+    char *path;
+    long long size;
+    struct timespec mtime;
+} KbuildCacheFile;
+
+KBUILD_DECLARE_DYNARR(KbuildCacheFile);
+KBUILD_DEFINE_DYNARR(KbuildCacheFile);
+
+static int kbuild_compare_cache_files(const void *a, const void *b) {
+    const KbuildCacheFile *file_a = a;
+    const KbuildCacheFile *file_b = b;
+
+    if (file_a->mtime.tv_sec != file_b->mtime.tv_sec) {
+        return file_a->mtime.tv_sec < file_b->mtime.tv_sec ? -1 : 1;
+    }
+
+    if (file_a->mtime.tv_nsec != file_b->mtime.tv_nsec) {
+        return file_a->mtime.tv_nsec < file_b->mtime.tv_nsec ? -1 : 1;
+    }
+
+    return 0;
+}
+
+void kbuild_prune_dir(const char *dir_path, long long max_bytes) {
+    KBUILD_DYNARR(KbuildCacheFile) *files = KBUILD_CREATE_DYNARR(KbuildCacheFile);
+    long long total_size = 0;
+
+    KbuildError error = KBUILD_OK;
+    KBUILD_FOREACH_FILE_OR_ERROR(dir_path, error, {
+        struct stat file_stat;
+        if (file_info.is_dir || stat(file_info.full_path, &file_stat) != 0) {
+            continue;
+        }
+
+        KbuildCacheFile file;
+        file.path = strdup(file_info.full_path);
+        file.size = file_stat.st_size;
+        file.mtime = file_stat.st_mtim;
+        KBUILD_DYNARR_PUSH_BACK(files, file);
+
+        total_size += file_stat.st_size;
+    });
+
+    // A cache that does not exist yet has nothing to prune
+    (void)error;
+
+    qsort(files->buffer, files->len, sizeof(KbuildCacheFile), kbuild_compare_cache_files);
+
+    for (int i = 0; i < files->len; i++) {
+        if (total_size > max_bytes && unlink(files->buffer[i].path) == 0) {
+            total_size -= files->buffer[i].size;
+        }
+
+        free(files->buffer[i].path);
+    }
+
+    KBUILD_FREE_DYNARR(files);
+}
+
+/**
+  * Starts packaging the .dwo files of object_files into output_file_path.dwp
+  * The .dwo files are complete once the objects are, so this runs alongside the link.
+  */
+static KbuildError kbuild_start_dwp(KBUILD_DYNARR(kbuild_str_t) *object_files, const char *output_file_path) {
+    // llvm-dwp also understands the DWARF 5 packages clang writes
+    char *dwp = kbuild_find_program("llvm-dwp");
+    if (dwp == NULL) {
+        dwp = kbuild_find_program("dwp");
+    }
+
+    if (dwp == NULL) {
+        return KBUILD_OK;
+    }
+
+    char *dwp_path = kbuild_output_sidecar_path(output_file_path, KBUILD_DWP_EXTENSION);
+    char *tmp_dwp_path = kbuild_output_sidecar_path(dwp_path, KBUILD_TMP_EXTENSION);
+
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_append_flag(builder, "", dwp);
+    kbuild_append_flag(builder, "-o ", tmp_dwp_path);
+
+    // Objects compiled without -g have no .dwo
+    int dwo_count = 0;
+    for (int i = 0; i < object_files->len; i++) {
+        char *dwo_path = kbuild_output_sidecar_path(object_files->buffer[i], KBUILD_DWO_EXTENSION);
+        if (access(dwo_path, F_OK) == 0) {
+            kbuild_append_flag(builder, "", dwo_path);
+            dwo_count++;
+        }
+        free(dwo_path);
+    }
+
+    KbuildError error = KBUILD_OK;
+    if (dwo_count > 0) {
+        char *cmd = kbuild_string_builder_build(builder);
+
+        KbuildJob *job = kbuild_create_job(dwp_path, KBUILD_ERROR_LINKING);
+        job->output_path = strdup(dwp_path);
+        job->timing_label = "Packaged";
+
+        error = kbuild_job_start(job, cmd);
+        free(cmd);
+    }
+
+    kbuild_free_string_builder(builder);
+    free(tmp_dwp_path);
+    free(dwp_path);
+    free(dwp);
+
+    return error;
+}
+
+KbuildError kbuild_link_files(KBUILD_DYNARR(kbuild_str_t) *object_files, const char *output_file_path) {
+    KbuildError error = kbuild_scheduler_init();
+    if (error != KBUILD_OK) {
+        return error;
+    }
+
+    const KbuildFlagSet *flags = kbuild_resolve_flags("");
+    char *ldflags = kbuild_resolve_ldflags();
+
+    KbuildStringBuilder *linker_builder = kbuild_create_string_builder();
+    kbuild_append_linker_flags(linker_builder, flags->cc, kbuild_scheduler.max_jobs);
+
+    char *lto_cache_dir = NULL;
+    if (kbuild_lto) {
+        const char *output_dir_end = strrchr(output_file_path, KBUILD_DIRECTORY_SEPARATOR);
+        char *output_dir = output_dir_end == NULL ? strdup("") : strndup(output_file_path, output_dir_end - output_file_path);
+
+        const char *cache_dir_parts[2];
+        cache_dir_parts[0] = output_dir;
+        cache_dir_parts[1] = KBUILD_LTO_CACHE_DIR_NAME;
+        lto_cache_dir = kbuild_join_paths(cache_dir_parts, 2);
+        free(output_dir);
+
+        kbuild_mkdir(lto_cache_dir);
+        kbuild_append_lto_flags(linker_builder, flags->cc, lto_cache_dir, kbuild_scheduler.max_jobs);
+    }
+
+    char *linker_flags = kbuild_string_builder_build(linker_builder);
+    kbuild_free_string_builder(linker_builder);
+
+    const char *command_parts[7];
+    command_parts[0] = flags->cc;
+    command_parts[1] = flags->cflags;
+    command_parts[2] = linker_flags;
+    command_parts[3] = ldflags;
+    command_parts[4] = "-o";
+    command_parts[5] = KBUILD_COMMAND_OUTPUT_SLOT;
+    command_parts[6] = KBUILD_COMMAND_INPUTS_SLOT;
+
+    char *template_cmd = kbuild_join_separator(command_parts, 7, " ");
+    KbuildCommandTemplate *template = kbuild_create_command_template(template_cmd);
+    free(template_cmd);
+
+    char *tmp_output_file_path = kbuild_output_sidecar_path(output_file_path, KBUILD_TMP_EXTENSION);
+
+    KbuildJob *job = kbuild_create_job(output_file_path, KBUILD_ERROR_LINKING);
+    job->output_path = strdup(output_file_path);
+    job->timing_label = "Linked";
+
+    // Flags only a shell understands
+    char *cmd = NULL;
+    if (template->args != NULL) {
+        job->argv = kbuild_fill_command_template(template, "", tmp_output_file_path, object_files);
+    } else {
+        command_parts[5] = tmp_output_file_path;
+        char *prefix = kbuild_join_separator(command_parts, 6, " ");
+        char *objects = kbuild_join_separator((const char**)object_files->buffer, object_files->len, " ");
+
+        const char *cmd_parts[2];
+        cmd_parts[0] = prefix;
+        cmd_parts[1] = objects;
+        cmd = kbuild_join_separator(cmd_parts, 2, " ");
+
+        free(prefix);
+        free(objects);
+    }
+    free(tmp_output_file_path);
+
+    error = kbuild_job_start(job, cmd);
+    if (error == KBUILD_OK && kbuild_split_dwarf) {
+        error = kbuild_start_dwp(object_files, output_file_path);
+    }
+
+    KbuildError jobs_error = kbuild_wait_jobs();
+
+    // GCC's incremental LTO cache is not a set of independent entries, it is
+    // left for GCC to manage
+    if (lto_cache_dir != NULL) {
+        if (kbuild_compiler_info(flags->cc).is_clang) {
+            kbuild_prune_dir(lto_cache_dir, kbuild_lto_cache_size);
+        }
+        free(lto_cache_dir);
+    }
+
+    // The arguments of the job pointed into it until it was flushed
+    kbuild_free_command_template(template);
+    free(cmd);
+    free(ldflags);
+    free(linker_flags);
+
+    return error != KBUILD_OK ? error : jobs_error;
 }
 
 #endif
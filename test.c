@@ -6,6 +6,39 @@
 #define TEST_FOREACH_MAX_FILE_NAME_SIZE 1024
 #define TEST_FOREACH_EXPECTED_FILE_COUNT 5
 
+/**
+  * Fresh directory for a test, under /tmp or relative to the working
+  * directory when in_cwd is set. remove_test_dir removes it with everything
+  * the test left in it.
+  */
+static char *create_test_dir(int in_cwd) {
+    char template_path[] = "/tmp/kbuild-test-XXXXXX";
+    char *dir_path = in_cwd ? template_path + strlen("/tmp/") : template_path;
+
+    return mkdtemp(dir_path) != NULL ? strdup(dir_path) : NULL;
+}
+
+static void remove_test_dir(char *dir_path) {
+    kbuild_remove_tree(dir_path);
+    free(dir_path);
+}
+
+static char *test_file_path(const char *dir_path, const char *name) {
+    const char *path_parts[] = { dir_path, name };
+    return kbuild_join_paths(path_parts, 2);
+}
+
+static void write_test_file(const char *dir_path, const char *name, const char *content) {
+    char *path = test_file_path(dir_path, name);
+
+    FILE *file = fopen(path, "w");
+    fputs(content, file);
+    fclose(file);
+
+    free(path);
+}
+
+
 KtestResult test_foreach_file() {
     const char *expected_files[TEST_FOREACH_EXPECTED_FILE_COUNT] = {
         "tests/fake-file-structure/abc",
@@ -335,6 +368,1146 @@ KtestResult test_dyn_array() {
     KBUILD_FREE_DYNARR(arr3);
 }
 
+KtestResult test_string_builder_json() {
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_string_builder_append_json(builder, "cc -DNAME=\"x\" a\\b.c\n\x01");
+
+    char *str = kbuild_string_builder_build(builder);
+    KTEST_ASSERT_EQ_STR(str, "\"cc -DNAME=\\\"x\\\" a\\\\b.c\\n\\u0001\"", "Should quote and escape the string");
+
+    free(str);
+    kbuild_free_string_builder(builder);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_compile_db() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *db_path = test_file_path(build_path, KBUILD_COMPILE_DB_FILE_NAME);
+
+    KbuildCompileDb *db = kbuild_compile_db_open(build_path);
+    kbuild_compile_db_add(db, "cc -c -o a.o a.c", "a.c", "a.o");
+    kbuild_compile_db_add(db, "cc -c -o b.o b.c", "b.c", "b.o");
+    kbuild_compile_db_close(db);
+
+    struct stat first_stat;
+    KTEST_ASSERT_EQ(stat(db_path, &first_stat), 0, "Should write the compile database");
+
+    // Same entries, the database must be left untouched
+    db = kbuild_compile_db_open(build_path);
+    kbuild_compile_db_add(db, "cc -c -o a.o a.c", "a.c", "a.o");
+    kbuild_compile_db_add(db, "cc -c -o b.o b.c", "b.c", "b.o");
+    kbuild_compile_db_close(db);
+
+    struct stat second_stat;
+    stat(db_path, &second_stat);
+    KTEST_ASSERT_EQ(first_stat.st_ino, second_stat.st_ino, "Should not rewrite an unchanged compile database");
+
+    // Dropping an entry must rewrite it
+    db = kbuild_compile_db_open(build_path);
+    kbuild_compile_db_add(db, "cc -c -o a.o a.c", "a.c", "a.o");
+    kbuild_compile_db_close(db);
+
+    char contents[256] = {0};
+    FILE *file = fopen(db_path, "rb");
+    fread(contents, 1, sizeof(contents) - 1, file);
+    fclose(file);
+
+    const char *expected = "[\n{\"directory\":";
+    KTEST_ASSERT_EQ(strncmp(contents, expected, strlen(expected)), 0, "Should start with the first entry");
+    KTEST_ASSERT_EQ(strstr(contents, "b.c"), NULL, "Should drop the removed entry");
+    KTEST_ASSERT_EQ_STR(contents + strlen(contents) - 4, "}\n]\n", "Should close the array");
+
+    // The jobs write to temporary paths, the database shows the final ones
+    const KbuildFlagSet *flags = kbuild_resolve_flags("a.c");
+    char *cmd = kbuild_compile_db_command(flags, "a.c", "build/a.o");
+    char *depfile_path = kbuild_output_sidecar_path("build/a.o", KBUILD_DEPFILE_EXTENSION);
+    char expected_depfile_flag[KBUILD_PATH_MAX];
+    snprintf(expected_depfile_flag, sizeof(expected_depfile_flag), "-MF %s ", depfile_path);
+
+    KTEST_ASSERT((strstr(cmd, KBUILD_TMP_EXTENSION) == NULL), "Should not show the temporary paths");
+    KTEST_ASSERT((strstr(cmd, "-c -o build/a.o a.c") != NULL), "Should show the real output");
+    KTEST_ASSERT((strstr(cmd, expected_depfile_flag) != NULL), "Should show the real depfile");
+
+    free(depfile_path);
+    free(cmd);
+    kbuild_config_reset();
+    remove_test_dir(build_path);
+    free(db_path);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_config_flags() {
+    kbuild_config_add_cflags(kbuild_config(""), "-O1");
+    kbuild_config_add_cflags(kbuild_config("src/fast/"), "-O3");
+    kbuild_config_add_include_path(kbuild_config("src"), "include");
+    kbuild_config_set_cc(kbuild_config("src/fast/simd.c"), "clang");
+    kbuild_config_add_define(kbuild_config("src/fast/simd.c"), "SIMD=1");
+
+    const KbuildFlagSet *slow = kbuild_resolve_flags("src/main.c");
+    const KbuildFlagSet *fast = kbuild_resolve_flags("src/fast/math.c");
+    const KbuildFlagSet *fast2 = kbuild_resolve_flags("src/fast/vector.c");
+    const KbuildFlagSet *simd = kbuild_resolve_flags("src/fast/simd.c");
+    const KbuildFlagSet *other = kbuild_resolve_flags("src/fastest/main.c");
+
+    KTEST_ASSERT_EQ_STR(slow->cc, KBUILD_CC, "Should use the default compiler");
+    KTEST_ASSERT_EQ_STR(slow->cflags, "-O1 -Iinclude", "Should inherit the global and directory flags");
+    KTEST_ASSERT_EQ_STR(fast->cflags, "-O1 -O3 -Iinclude", "Should apply the innermost flags last");
+    KTEST_ASSERT_EQ_STR(simd->cc, "clang", "Should override the compiler for a single file");
+    KTEST_ASSERT_EQ_STR(simd->cflags, "-O1 -O3 -Iinclude -DSIMD=1", "Should add the file defines");
+    KTEST_ASSERT_EQ_STR(other->cflags, "-O1 -Iinclude", "Should only match whole path components");
+
+    KTEST_ASSERT_EQ(fast, fast2, "Should intern identical flag sets");
+    KTEST_ASSERT_EQ(slow, other, "Should intern identical flag sets");
+    KTEST_ASSERT((fast->id != slow->id), "Should give different flag sets different ids");
+    KTEST_ASSERT((kbuild_intern_flag_set("a", "b c")->id != kbuild_intern_flag_set("a b", "c")->id), "Should not mix the compiler and the flags");
+
+    kbuild_config_add_cflags(kbuild_config("src/fast"), "-funroll-loops");
+    kbuild_config_add_define(kbuild_config("src/fast/math.c"), "FAST=1");
+
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_flags("src/fast/vector.c")->cflags, "-O1 -O3 -funroll-loops -Iinclude", "Should see config changes made after resolving");
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_flags("src/fast/math.c")->cflags, "-O1 -O3 -funroll-loops -Iinclude -DFAST=1", "Should see file configs added after resolving");
+    KTEST_ASSERT_EQ(kbuild_resolve_flags("src/main.c"), kbuild_resolve_flags("src/util.c"), "Should share the flags of a directory");
+
+    kbuild_config_reset();
+
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_flags("src/main.c")->cflags, KBUILD_CFLAGS, "Should go back to the defaults after a reset");
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_parse_depfile() {
+    char depfile_path[] = "/tmp/kbuild-test-depfile-XXXXXX";
+    int fd = mkstemp(depfile_path);
+    KTEST_ASSERT((fd >= 0), "Should create a temporary depfile");
+
+    const char *contents = "build/main.o: src/main.c include/a.h \\\n include/with\\ space.h\n\ninclude/a.h:\n";
+    write(fd, contents, strlen(contents));
+    close(fd);
+
+    KBUILD_DYNARR(kbuild_str_t) *dependencies = kbuild_parse_depfile(depfile_path);
+    KTEST_ASSERT((dependencies != NULL), "Should parse the depfile");
+    KTEST_ASSERT_EQ(dependencies->len, 3, "Should find every prerequisite and skip the targets");
+    KTEST_ASSERT_EQ_STR(dependencies->buffer[0], "src/main.c", "Should find the source");
+    KTEST_ASSERT_EQ_STR(dependencies->buffer[1], "include/a.h", "Should find the header");
+    KTEST_ASSERT_EQ_STR(dependencies->buffer[2], "include/with space.h", "Should unescape spaces");
+
+    for (int i = 0; i < dependencies->len; i++) {
+        free(dependencies->buffer[i]);
+    }
+    KBUILD_FREE_DYNARR(dependencies);
+    unlink(depfile_path);
+
+    KTEST_ASSERT_EQ(kbuild_parse_depfile("/nonexistent/file.d"), NULL, "Should return NULL for a missing depfile");
+
+    return KTEST_RESULT_OK;
+}
+
+static int silence_stderr() {
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    return saved_stderr;
+}
+
+static void restore_stderr(int saved_stderr) {
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+}
+
+KtestResult test_compile_log() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *source_path = test_file_path(build_path, "warning.c");
+    char *object_path = test_file_path(build_path, "warning.o");
+
+    FILE *source = fopen(source_path, "w");
+    fputs("#warning kbuild-test-warning\nint main() { return 0; }\n", source);
+    fclose(source);
+
+    // The warning goes to stderr, keep the test output clean
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT_EQ(error, KBUILD_OK, "Should compile a file with warnings");
+
+    char *log_path = kbuild_output_sidecar_path(object_path, KBUILD_LOG_EXTENSION);
+    char log_contents[1024] = {0};
+    FILE *log = fopen(log_path, "rb");
+    KTEST_ASSERT((log != NULL), "Should save the output of the compiler");
+    fread(log_contents, 1, sizeof(log_contents) - 1, log);
+    fclose(log);
+
+    KTEST_ASSERT((strstr(log_contents, "kbuild-test-warning") != NULL), "Should capture the warnings");
+    KTEST_ASSERT(!kbuild_needs_compile(source_path, object_path, kbuild_resolve_flags(source_path)), "Should be up to date after compiling");
+
+    remove_test_dir(build_path);
+    free(log_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_compile_error() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *source_path = test_file_path(build_path, "broken.c");
+    char *object_path = test_file_path(build_path, "broken.o");
+
+    FILE *source = fopen(source_path, "w");
+    fputs("int broken(\n", source);
+    fclose(source);
+
+    // A stale object from an earlier build must not survive the failure
+    FILE *object = fopen(object_path, "w");
+    fclose(object);
+
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_COMPILING, "Should return the error instead of exiting");
+    KTEST_ASSERT((access(object_path, F_OK) != 0), "Should remove the output of the failed job");
+    KTEST_ASSERT_EQ(kbuild_wait_jobs(), KBUILD_OK, "Should not carry the failure over to the next jobs");
+
+    remove_test_dir(build_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_sweep_tmp_files() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *sub_path = test_file_path(build_path, "sub");
+    mkdir(sub_path, 0755);
+
+    char *tmp_path = test_file_path(sub_path, "main.o" KBUILD_TMP_EXTENSION);
+    char *object_path = test_file_path(sub_path, "main.o");
+
+    fclose(fopen(tmp_path, "w"));
+    fclose(fopen(object_path, "w"));
+
+    kbuild_sweep_tmp_files(build_path);
+
+    KTEST_ASSERT((access(tmp_path, F_OK) != 0), "Should remove leftover temporary outputs");
+    KTEST_ASSERT((access(object_path, F_OK) == 0), "Should keep the finished outputs");
+
+    remove_test_dir(build_path);
+    free(object_path);
+    free(tmp_path);
+    free(sub_path);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_mkdir_cache() {
+    char *root_path = create_test_dir(0);
+    KTEST_ASSERT((root_path != NULL), "Should create a temporary directory");
+
+    char *dir_path = test_file_path(root_path, "a/b");
+    char *parent_path = test_file_path(root_path, "a");
+
+    KTEST_ASSERT_EQ(kbuild_mkdir(dir_path), 0, "Should create the directory and its parents");
+    KTEST_ASSERT_EQ(kbuild_mkdir(""), 0, "Should have nothing to create for an empty path");
+    KTEST_ASSERT(kbuild_is_dir(dir_path), "Should create the directory");
+
+    // Removed behind the cache's back, so only a reset brings it back
+    rmdir(dir_path);
+    KTEST_ASSERT_EQ(kbuild_mkdir(dir_path), 0, "Should trust the cache");
+    KTEST_ASSERT((!kbuild_is_dir(dir_path)), "Should not touch the filesystem for a cached directory");
+
+    kbuild_reset_dir_cache();
+    KTEST_ASSERT_EQ(kbuild_mkdir(dir_path), 0, "Should create the directory again");
+    KTEST_ASSERT(kbuild_is_dir(dir_path), "Should create the directory after a reset");
+
+    remove_test_dir(root_path);
+    free(parent_path);
+    free(dir_path);
+    kbuild_reset_dir_cache();
+
+    return KTEST_RESULT_OK;
+}
+
+// Few distinct hashes, so removals have long probe sequences to repair
+static uint64_t test_int_hash(int key) {
+    return (uint64_t)(key % 7);
+}
+
+static int test_int_eq(int a, int b) {
+    return a == b;
+}
+
+KBUILD_DECLARE_HASHMAP(test_int_to_int, int, int);
+KBUILD_DEFINE_HASHMAP(test_int_to_int, int, int, test_int_hash, test_int_eq);
+
+KtestResult test_hashmap() {
+    KBUILD_HASHMAP(test_int_to_int) *map = KBUILD_CREATE_HASHMAP(test_int_to_int);
+
+    for (int i = 0; i < 100; i++) {
+        KBUILD_HASHMAP_PUT(test_int_to_int, map, i, i * 10);
+    }
+    KBUILD_HASHMAP_PUT(test_int_to_int, map, 5, 42);
+
+    KTEST_ASSERT_EQ(map->len, 100, "Should not duplicate keys");
+    KTEST_ASSERT_EQ(map->values[KBUILD_HASHMAP_FIND(test_int_to_int, map, 5)], 42, "Should overwrite the value of an existing key");
+
+    for (int i = 0; i < 100; i += 2) {
+        KTEST_ASSERT_EQ(KBUILD_HASHMAP_REMOVE(test_int_to_int, map, i), 1, "Should remove existing keys");
+    }
+    KTEST_ASSERT_EQ(KBUILD_HASHMAP_REMOVE(test_int_to_int, map, 0), 0, "Should not remove a missing key");
+    KTEST_ASSERT_EQ(map->len, 50, "Should count the removals");
+
+    for (int i = 0; i < 100; i++) {
+        int slot = KBUILD_HASHMAP_FIND(test_int_to_int, map, i);
+        if (i % 2 == 0) {
+            KTEST_ASSERT_EQ(slot, -1, "Should not find removed keys");
+        } else {
+            KTEST_ASSERT((slot >= 0), "Should still find the colliding keys after removals");
+            KTEST_ASSERT_EQ(map->values[slot], i == 5 ? 42 : i * 10, "Should keep the values");
+        }
+    }
+
+    KBUILD_FREE_HASHMAP(test_int_to_int, map);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_intern_table() {
+    KbuildInternTable *table = kbuild_create_intern_table();
+
+    int a = kbuild_intern(table, "a.h");
+    int b = kbuild_intern(table, "b.h");
+
+    KTEST_ASSERT_EQ(a, 0, "Should count ids from 0");
+    KTEST_ASSERT_EQ(b, 1, "Should give the next string the next id");
+    KTEST_ASSERT_EQ(kbuild_intern(table, "a.h"), a, "Should return the same id for the same string");
+    KTEST_ASSERT_EQ(kbuild_intern_find(table, "c.h"), -1, "Should not find a string that was never interned");
+    KTEST_ASSERT_EQ_STR(kbuild_interned_string(table, b), "b.h", "Should map the id back to the string");
+
+    int path = kbuild_intern_path(table, "src//sub/./util.h");
+    KTEST_ASSERT_EQ(kbuild_intern_path(table, "./src/sub/util.h/"), path, "Should normalize paths");
+    KTEST_ASSERT_EQ_STR(kbuild_interned_string(table, path), "src/sub/util.h", "Should store the normalized path");
+    KTEST_ASSERT_EQ_STR(kbuild_interned_string(table, kbuild_intern_path(table, "//usr/include")), "/usr/include", "Should keep absolute paths absolute");
+
+    kbuild_free_intern_table(table);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_find_program() {
+    char *sh = kbuild_find_program("sh");
+    KTEST_ASSERT((sh != NULL), "Should find a program on PATH");
+    KTEST_ASSERT((access(sh, X_OK) == 0), "Should return an executable path");
+    KTEST_ASSERT((kbuild_find_program("kbuild-no-such-program") == NULL), "Should not find a missing program");
+
+    free(sh);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_prune_dir() {
+    char *cache_path = create_test_dir(0);
+    KTEST_ASSERT((cache_path != NULL), "Should create a temporary cache directory");
+
+    const char *names[] = { "old", "middle", "new" };
+    char *paths[3];
+
+    for (int i = 0; i < 3; i++) {
+        paths[i] = test_file_path(cache_path, names[i]);
+
+        FILE *file = fopen(paths[i], "w");
+        for (int j = 0; j < (i + 1) * 10; j++) {
+            fputc('x', file);
+        }
+        fclose(file);
+
+        struct timespec times[2];
+        times[0].tv_sec = 1000 + i;
+        times[0].tv_nsec = 0;
+        times[1] = times[0];
+        utimensat(AT_FDCWD, paths[i], times, 0);
+    }
+
+    kbuild_prune_dir(cache_path, 35);
+
+    KTEST_ASSERT((access(paths[0], F_OK) != 0), "Should remove the oldest file first");
+    KTEST_ASSERT((access(paths[1], F_OK) != 0), "Should keep removing until the size fits");
+    KTEST_ASSERT((access(paths[2], F_OK) == 0), "Should keep the newest file");
+
+    for (int i = 0; i < 3; i++) {
+        free(paths[i]);
+    }
+    remove_test_dir(cache_path);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_pending_compile_order() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *small_path = test_file_path(build_path, "small.c");
+    char *large_path = test_file_path(build_path, "large.c");
+
+    FILE *small = fopen(small_path, "w");
+    fputs("int small;\n", small);
+    fclose(small);
+
+    FILE *large = fopen(large_path, "w");
+    for (int i = 0; i < 100; i++) {
+        fputs("int large_padding;\n", large);
+    }
+    fclose(large);
+
+    const KbuildFlagSet *flags = kbuild_resolve_flags(small_path);
+
+    KBUILD_DYNARR(kbuild_pending_compile_ptr_t) *pending = KBUILD_CREATE_DYNARR(kbuild_pending_compile_ptr_t);
+    KBUILD_DYNARR_PUSH_BACK(pending, kbuild_create_pending_compile(small_path, "small.o", flags));
+    KBUILD_DYNARR_PUSH_BACK(pending, kbuild_create_pending_compile(large_path, "large.o", flags));
+
+    qsort(pending->buffer, pending->len, sizeof(kbuild_pending_compile_ptr_t), kbuild_compare_pending_compiles);
+
+    KTEST_ASSERT_EQ_STR(pending->buffer[0]->input_path, large_path, "Should start the most expensive compile first");
+    KTEST_ASSERT((pending->buffer[1]->dependencies == NULL), "Should not know dependencies before a first build");
+
+    for (int i = 0; i < pending->len; i++) {
+        kbuild_free_pending_compile(pending->buffer[i]);
+    }
+    KBUILD_FREE_DYNARR(pending);
+
+    remove_test_dir(build_path);
+    free(small_path);
+    free(large_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_job_stats() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *source_path = test_file_path(build_path, "a,b.c");
+    char *object_path = test_file_path(build_path, "a,b.o");
+    char *csv_path = test_file_path(build_path, "stats.csv");
+
+    FILE *source = fopen(source_path, "w");
+    fputs("int answer(void) { return 42; }\n", source);
+    fclose(source);
+
+    kbuild_reset_job_stats();
+    KTEST_ASSERT_EQ(kbuild_compile(source_path, object_path), KBUILD_OK, "Should compile");
+
+    const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *stats = kbuild_job_stats();
+    KTEST_ASSERT_EQ(stats->len, 1, "Should record the finished job");
+    KTEST_ASSERT_EQ_STR(stats->buffer[0]->kind, "compile", "Should tell compiles apart");
+    KTEST_ASSERT((stats->buffer[0]->max_rss_kb > 0), "Should record the peak RSS of the compiler");
+
+    KTEST_ASSERT_EQ(kbuild_write_job_stats(csv_path), KBUILD_OK, "Should write the CSV");
+
+    char line[KBUILD_PATH_MAX];
+    FILE *csv = fopen(csv_path, "r");
+    fgets(line, sizeof(line), csv);
+    KTEST_ASSERT_EQ_STR(line, "job,kind,status,wall_seconds,user_seconds,system_seconds,max_rss_kb,in_blocks,out_blocks\n", "Should start with the header");
+    fgets(line, sizeof(line), csv);
+    fclose(csv);
+
+    char expected_prefix[KBUILD_PATH_MAX];
+    snprintf(expected_prefix, sizeof(expected_prefix), "\"%s\",compile,0,", source_path);
+    KTEST_ASSERT((strncmp(line, expected_prefix, strlen(expected_prefix)) == 0), "Should quote the job and write one row per job");
+
+    // Exits cleanly without writing the object, so moving it into place fails
+    kbuild_config_set_cc(kbuild_config(source_path), "true");
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_COMPILING, "Should fail a job without an output");
+    KTEST_ASSERT_EQ(stats->len, 2, "Should record the failed job");
+    KTEST_ASSERT_EQ(stats->buffer[1]->status, 1, "Should record the status after the outputs are moved into place");
+
+    kbuild_reset_job_stats();
+    remove_test_dir(build_path);
+    free(csv_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_fanout_report() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "a.o.d", "a.o: src/a.c include/common.h \\\n include/a.h\n");
+    write_test_file(build_path, "a.o.kbuild", "flags 0000000000000001\ncpu 2.000000\n");
+    write_test_file(build_path, "b.o.d", "b.o: src/b.c ./include/common.h\n");
+    write_test_file(build_path, "b.o.kbuild", "flags 0000000000000001\ncpu 1.000000\n");
+    // Compiled before times were recorded
+    write_test_file(build_path, "c.o.d", "c.o: src/c.c include/common.h\n");
+    write_test_file(build_path, "c.o.kbuild", "flags 0000000000000001\n");
+
+    KbuildFanoutReport *report = kbuild_analyze_fanout(build_path);
+
+    KTEST_ASSERT_EQ(report->translation_units, 3, "Should read every depfile");
+    KTEST_ASSERT_EQ(report->headers->strs->len, 2, "Should count each header once");
+
+    int common = report->ranked[0];
+    int a = report->ranked[1];
+    KTEST_ASSERT_EQ_STR(kbuild_interned_string(report->headers, common), "include/common.h", "Should rank the most expensive header first");
+    KTEST_ASSERT_EQ(report->dependents[common], 3, "Should count the units including the header");
+    KTEST_ASSERT((report->cost_seconds[common] > 2.999 && report->cost_seconds[common] < 3.001), "Should add up the recorded compile times");
+    KTEST_ASSERT_EQ_STR(kbuild_interned_string(report->headers, a), "include/a.h", "Should rank the cheaper header after");
+    KTEST_ASSERT_EQ(report->dependents[a], 1, "Should count a header included by a single unit");
+
+    kbuild_free_fanout_report(report);
+
+    remove_test_dir(build_path);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_hermetic_compile() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *sub_path = test_file_path(build_path, "sub");
+    mkdir(sub_path, 0755);
+    write_test_file(sub_path, "dep.h", "#define DEP 1\n");
+    write_test_file(build_path, "main.c", "#include \"sub/dep.h\"\nint main() { return DEP - 1; }\n");
+
+    char *source_path = test_file_path(build_path, "main.c");
+    char *object_path = test_file_path(build_path, "main.o");
+
+    kbuild_set_hermetic(1);
+    KbuildError error = kbuild_compile(source_path, object_path);
+    kbuild_set_hermetic(0);
+
+    KTEST_ASSERT_EQ(error, KBUILD_OK, "Should compile with the tracer preloaded");
+    KTEST_ASSERT((kbuild_tracer_path != NULL && access(kbuild_tracer_path, R_OK) == 0), "Should build the tracer library");
+
+    char *depfile_path = kbuild_output_sidecar_path(object_path, KBUILD_DEPFILE_EXTENSION);
+    KBUILD_DYNARR(kbuild_str_t) *dependencies = kbuild_parse_depfile(depfile_path);
+    KTEST_ASSERT((dependencies != NULL), "Should write a depfile from the trace");
+    KTEST_ASSERT_EQ_STR(dependencies->buffer[0], source_path, "Should list the source first");
+
+    char *real_header_path = realpath(build_path, NULL);
+    const char *header_path_parts[] = { real_header_path, "sub", "dep.h" };
+    char *header_path = kbuild_join_paths(header_path_parts, 3);
+    int found_header = 0;
+    for (int i = 0; i < dependencies->len; i++) {
+        found_header |= strcmp(dependencies->buffer[i], header_path) == 0;
+    }
+    KTEST_ASSERT(found_header, "Should list the header the compiler read");
+
+    char *trace_path = kbuild_output_sidecar_path(object_path, KBUILD_TRACE_EXTENSION);
+    KTEST_ASSERT((access(trace_path, F_OK) != 0), "Should remove the trace");
+
+    kbuild_free_strs(dependencies);
+
+    unlink(kbuild_tracer_path);
+    remove_test_dir(build_path);
+
+    free(kbuild_tracer_path);
+    kbuild_tracer_path = NULL;
+
+    free(trace_path);
+    free(depfile_path);
+    free(header_path);
+    free(real_header_path);
+    free(object_path);
+    free(source_path);
+    free(sub_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_sha256() {
+    char hex[KBUILD_SHA256_DIGEST_SIZE * 2 + 1];
+    KbuildSha256 sha;
+
+    kbuild_sha256_init(&sha);
+    kbuild_sha256_final_hex(&sha, hex);
+    KTEST_ASSERT_EQ_STR(hex, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "Should hash the empty input");
+
+    kbuild_sha256_init(&sha);
+    kbuild_sha256_update(&sha, "abc", 3);
+    kbuild_sha256_final_hex(&sha, hex);
+    KTEST_ASSERT_EQ_STR(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", "Should hash a single block");
+
+    // The padding no longer fits in the block of the message
+    const char *message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    kbuild_sha256_init(&sha);
+    kbuild_sha256_update(&sha, message, 20);
+    kbuild_sha256_update(&sha, message + 20, strlen(message) - 20);
+    kbuild_sha256_final_hex(&sha, hex);
+    KTEST_ASSERT_EQ_STR(hex, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", "Should hash input fed in pieces");
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_local_executor() {
+    // Relative, so the compile runs against the staged copies
+    char *build_path = create_test_dir(1);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    char *sub_path = test_file_path(build_path, "sub");
+    mkdir(sub_path, 0755);
+    write_test_file(sub_path, "dep.h", "#include \"value.h\"\n#define DEP VALUE\n");
+    write_test_file(sub_path, "value.h", "#define VALUE 1\n");
+    write_test_file(build_path, "main.c", "#include <stdio.h>\n#include \"sub/dep.h\"\nint main() { return DEP - 1; }\n");
+
+    char *source_path = test_file_path(build_path, "main.c");
+    char *object_path = test_file_path(build_path, "main.o");
+    char *cas_path = test_file_path(build_path, "cas");
+
+    KbuildExecutor *executor = kbuild_create_local_executor(cas_path);
+    KbuildLocalExecutor *local = executor->data;
+    kbuild_set_executor(executor);
+
+    KTEST_ASSERT_EQ(kbuild_compile(source_path, object_path), KBUILD_OK, "Should compile through the executor");
+    KTEST_ASSERT((access(object_path, F_OK) == 0), "Should download the object");
+    KTEST_ASSERT_EQ(local->blobs_uploaded, 5, "Should upload the source, both headers, the object and the depfile");
+
+    DIR *exec_dir = opendir(local->exec_path);
+    int leftover_entries = 0;
+    struct dirent *entry;
+    while ((entry = readdir(exec_dir)) != NULL) {
+        leftover_entries += entry->d_name[0] != '.';
+    }
+    closedir(exec_dir);
+    KTEST_ASSERT_EQ(leftover_entries, 0, "Should remove the working directory of the action");
+
+    // Blobs are pruned by mtime, the ones used again have to look recent
+    DIR *blobs_dir = opendir(local->blobs_path);
+    while ((entry = readdir(blobs_dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            struct timespec times[2] = { { 1000, 0 }, { 1000, 0 } };
+            utimensat(dirfd(blobs_dir), entry->d_name, times, 0);
+        }
+    }
+    closedir(blobs_dir);
+
+    KTEST_ASSERT_EQ(kbuild_compile(source_path, object_path), KBUILD_OK, "Should compile again");
+    KTEST_ASSERT_EQ(local->blobs_uploaded, 5, "Should not upload unchanged files twice");
+    KTEST_ASSERT((local->blobs_reused >= 3), "Should reuse the blobs of the inputs");
+    KTEST_ASSERT_EQ(local->digests_reused, 3, "Should not hash unchanged inputs again");
+
+    int touched_blobs = 0;
+    blobs_dir = opendir(local->blobs_path);
+    while ((entry = readdir(blobs_dir)) != NULL) {
+        struct stat blob_stat;
+        if (entry->d_name[0] != '.' && fstatat(dirfd(blobs_dir), entry->d_name, &blob_stat, 0) == 0) {
+            touched_blobs += blob_stat.st_mtim.tv_sec > 1000;
+        }
+    }
+    closedir(blobs_dir);
+    KTEST_ASSERT((touched_blobs >= 3), "Should touch the blobs it reuses");
+
+    // The output of the command comes back with collect
+    int saved_stderr;
+    KbuildError error;
+    write_test_file(build_path, "main.c", "#include \"sub/dep.h\"\n#warning from the executor\nint main() { return DEP - 1; }\n");
+    saved_stderr = silence_stderr();
+    error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+    KTEST_ASSERT_EQ(error, KBUILD_OK, "Should compile with a warning");
+    char *log_path = kbuild_output_sidecar_path(object_path, KBUILD_LOG_EXTENSION);
+    char log[512] = {0};
+    FILE *log_file = fopen(log_path, "rb");
+    KTEST_ASSERT((log_file != NULL), "Should keep the output of the compile");
+    fread(log, 1, sizeof(log) - 1, log_file);
+    fclose(log_file);
+    KTEST_ASSERT((strstr(log, "from the executor") != NULL), "Should collect the output of the action");
+
+    // Includes named by a macro are not found by the scan
+    write_test_file(build_path, "main.c", "#define DEP_HEADER \"sub/dep.h\"\n#include DEP_HEADER\nint main() { return DEP - 1; }\n");
+    char *depfile_path = kbuild_output_sidecar_path(object_path, KBUILD_DEPFILE_EXTENSION);
+    unlink(depfile_path);
+
+    saved_stderr = silence_stderr();
+    error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_COMPILING, "Should only see the inputs of the action");
+
+    kbuild_set_executor(NULL);
+    kbuild_free_executor(executor);
+    remove_test_dir(build_path);
+
+    free(log_path);
+    free(depfile_path);
+    free(cas_path);
+    free(object_path);
+    free(source_path);
+    free(sub_path);
+    kbuild_config_reset();
+    kbuild_reset_dir_cache();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_preprocess_pipeline() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "value.h", "#define VALUE 42\n");
+
+    const int sources = 6;
+    char *source_paths[6];
+    char *object_paths[6];
+    for (int i = 0; i < sources; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "unit%d.c", i);
+        write_test_file(build_path, name, "#include \"value.h\"\nint value(void) { return VALUE; }\n");
+
+        source_paths[i] = test_file_path(build_path, name);
+        name[strlen(name) - 1] = 'o';
+        object_paths[i] = test_file_path(build_path, name);
+    }
+
+    // More sources than both stages have slots
+    KTEST_ASSERT_EQ(kbuild_scheduler_init(), KBUILD_OK, "Should start the scheduler");
+    int max_jobs = kbuild_scheduler.max_jobs;
+    kbuild_set_jobs(1);
+    kbuild_set_preprocess_jobs(2);
+    kbuild_reset_job_stats();
+
+    for (int i = 0; i < sources; i++) {
+        KTEST_ASSERT_EQ(kbuild_compile_with_flags(kbuild_resolve_flags(source_paths[i]), source_paths[i], object_paths[i]), KBUILD_OK, "Should queue the compile");
+        KTEST_ASSERT((kbuild_scheduler.running_preprocess + kbuild_scheduler.ready->len <= 2), "Should hold at most two preprocessed sources");
+    }
+    KTEST_ASSERT_EQ(kbuild_wait_jobs(), KBUILD_OK, "Should compile every source");
+
+    kbuild_set_preprocess_jobs(0);
+    kbuild_set_jobs(max_jobs);
+
+    KTEST_ASSERT_EQ(kbuild_job_stats()->len, sources, "Should count both stages as one job");
+
+    for (int i = 0; i < sources; i++) {
+        KTEST_ASSERT((access(object_paths[i], F_OK) == 0), "Should compile the preprocessed source");
+
+        char *depfile_path = kbuild_output_sidecar_path(object_paths[i], KBUILD_DEPFILE_EXTENSION);
+        KBUILD_DYNARR(kbuild_str_t) *dependencies = kbuild_parse_depfile(depfile_path);
+        KTEST_ASSERT((dependencies != NULL && dependencies->len == 2), "Should write the depfile while preprocessing");
+        kbuild_free_strs(dependencies);
+        free(depfile_path);
+    }
+
+    remove_test_dir(build_path);
+    for (int i = 0; i < sources; i++) {
+        free(source_paths[i]);
+        free(object_paths[i]);
+    }
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_split_command() {
+    KBUILD_DYNARR(kbuild_str_t) *args = kbuild_split_command("cc  -O2 '-DA=a b' \"-DB=\\\"q\\\"\" -I\\ x");
+    KTEST_ASSERT((args != NULL), "Should split a quoted command");
+    KTEST_ASSERT_EQ(args->len, 5, "Should split on unquoted blanks only");
+    KTEST_ASSERT_EQ_STR(args->buffer[2], "-DA=a b", "Should keep single quoted text as is");
+    KTEST_ASSERT_EQ_STR(args->buffer[3], "-DB=\"q\"", "Should unescape in double quotes");
+    KTEST_ASSERT_EQ_STR(args->buffer[4], "-I x", "Should unescape outside quotes");
+    kbuild_free_strs(args);
+
+    // Only special at the start of a word
+    args = kbuild_split_command("cc -DA=x~y -DB=a#b");
+    KTEST_ASSERT((args != NULL), "Should split words with ~ and # inside");
+    KTEST_ASSERT_EQ_STR(args->buffer[1], "-DA=x~y", "Should keep a ~ inside a word");
+    KTEST_ASSERT_EQ_STR(args->buffer[2], "-DB=a#b", "Should keep a # inside a word");
+    kbuild_free_strs(args);
+
+    KTEST_ASSERT_EQ(kbuild_split_command("cc -I ~/include"), NULL, "Should leave tilde expansion to the shell");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc -c x.c # comment"), NULL, "Should leave comments to the shell");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc '-DA=a b"), NULL, "Should not split an unterminated single quote");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc \"-DA=a b"), NULL, "Should not split an unterminated double quote");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc -c x.c \\"), NULL, "Should not split a trailing backslash");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc $(pkg-config --cflags x)"), NULL, "Should leave expansions to the shell");
+    KTEST_ASSERT_EQ(kbuild_split_command("cc -c x.c | tee log"), NULL, "Should leave pipes to the shell");
+    KTEST_ASSERT_EQ(kbuild_split_command("CCACHE_DISABLE=1 cc"), NULL, "Should leave assignments to the shell");
+    KTEST_ASSERT_EQ(kbuild_split_command("  "), NULL, "Should not split a blank command");
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_prepared_command() {
+    const KbuildFlagSet *flags = kbuild_intern_flag_set("cc", "-O2 -DNAME='\"x y\"'");
+    char **argv = kbuild_prepare_command(flags, KBUILD_COMMAND_COMPILE, "in dir/a.c", "out/a.o");
+    KTEST_ASSERT((argv != NULL), "Should prepare the command");
+    KTEST_ASSERT_EQ_STR(argv[0], "cc", "Should start with the compiler");
+    KTEST_ASSERT_EQ_STR(argv[3], "out/a.o" KBUILD_TMP_EXTENSION, "Should patch in the temporary output");
+    KTEST_ASSERT_EQ_STR(argv[4], "in dir/a.c", "Should patch in the input as a single argument");
+    KTEST_ASSERT_EQ_STR(argv[6], "-DNAME=\"x y\"", "Should split the flags once like the shell");
+
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    KTEST_ASSERT_EQ_STR(argv[argc - 1], "out/a.o", "Should patch in the depfile target");
+
+    // The template is shared, only the slots differ between jobs
+    char **other_argv = kbuild_prepare_command(flags, KBUILD_COMMAND_COMPILE, "b.c", "b.o");
+    KTEST_ASSERT_EQ(argv[0], other_argv[0], "Should reuse the constant arguments");
+    KTEST_ASSERT_EQ_STR(other_argv[4], "b.c", "Should patch in the other input");
+    free(argv);
+    free(other_argv);
+
+    KTEST_ASSERT_EQ(kbuild_prepare_command(kbuild_intern_flag_set("cc", "`echo -O2`"), KBUILD_COMMAND_COMPILE, "a.c", "a.o"), NULL, "Should fall back to the shell");
+
+    // Without a shell in between, paths with blanks just work
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+    write_test_file(build_path, "with space.c", "const char *name = NAME;\n");
+
+    char *source_path = test_file_path(build_path, "with space.c");
+    char *object_path = test_file_path(build_path, "with space.o");
+
+    KTEST_ASSERT_EQ(kbuild_compile_with_flags(flags, source_path, object_path), KBUILD_OK, "Should start the compile");
+    KTEST_ASSERT_EQ(kbuild_wait_jobs(), KBUILD_OK, "Should compile without a shell");
+    KTEST_ASSERT((access(object_path, F_OK) == 0), "Should write the object");
+
+    remove_test_dir(build_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_late_exit() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "late.c", "int late(void) { return 0; }\n");
+    char *source_path = test_file_path(build_path, "late.c");
+    char *object_path = test_file_path(build_path, "late.o");
+
+    // The output is closed well before the process exits
+    kbuild_config_set_cc(kbuild_config(source_path), "sh -c 'exec >&- 2>&-; sleep 0.2; exit 3' sh");
+
+    kbuild_reset_job_stats();
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_COMPILING, "Should fail the job");
+    const KBUILD_DYNARR(kbuild_job_stats_ptr_t) *stats = kbuild_job_stats();
+    KTEST_ASSERT_EQ(stats->len, 1, "Should record the job once it exits");
+    KTEST_ASSERT_EQ(stats->buffer[0]->status, 3, "Should get the exit status of the process");
+    KTEST_ASSERT((stats->buffer[0]->wall_seconds >= 0.2), "Should wait for the process to exit");
+    KTEST_ASSERT_EQ(kbuild_wait_jobs(), KBUILD_OK, "Should not carry the failure over to the next jobs");
+
+    kbuild_reset_job_stats();
+    remove_test_dir(build_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+static void test_signal_handler(int signal) {
+    (void)signal;
+}
+
+KtestResult test_interrupt() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "a.c", "int a(void) { return 0; }\n");
+    char *source_path = test_file_path(build_path, "a.c");
+    char *object_path = test_file_path(build_path, "a.o");
+
+    struct sigaction action;
+    struct sigaction saved_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = test_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &saved_action);
+
+    kbuild_set_keep_going(1);
+    kbuild_interrupted = 1;
+
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_INTERRUPTED, "Should stop the build");
+    KTEST_ASSERT(kbuild_scheduler.keep_going, "Should leave keep going mode on for the next build");
+    KTEST_ASSERT_EQ(kbuild_compile(source_path, object_path), KBUILD_OK, "Should build again after the interrupt");
+
+    struct sigaction current_action;
+    sigaction(SIGINT, NULL, &current_action);
+    KTEST_ASSERT((current_action.sa_handler == test_signal_handler), "Should restore the previous handler when the build ends");
+
+    sigaction(SIGINT, &saved_action, NULL);
+    kbuild_set_keep_going(0);
+    remove_test_dir(build_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+static char *write_fake_compiler(const char *dir_path, const char *name, const char *version_line, const char *version) {
+    char content[256];
+    snprintf(content, sizeof(content), "#!/bin/sh\ncase \"$1\" in\n--version) echo '%s' ;;\n-dumpversion) echo %s ;;\nesac\n", version_line, version);
+    write_test_file(dir_path, name, content);
+
+    char *path = test_file_path(dir_path, name);
+    chmod(path, 0755);
+
+    return path;
+}
+
+KtestResult test_lto_flags() {
+    char *tools_path = create_test_dir(0);
+    KTEST_ASSERT((tools_path != NULL), "Should create a temporary directory");
+
+    char *gcc = write_fake_compiler(tools_path, "gcc", "gcc (GCC) 15.1.0", "15");
+    char *old_gcc = write_fake_compiler(tools_path, "old-gcc", "gcc (GCC) 12.2.0", "12");
+    char *clang = write_fake_compiler(tools_path, "clang", "clang version 18.1.0", "18");
+
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_append_lto_flags(builder, gcc, "build/lto-cache", 4);
+    char *gcc_flags = kbuild_string_builder_build(builder);
+    KTEST_ASSERT_EQ_STR(gcc_flags, "-flto=4 -flto-incremental=build/lto-cache", "Should use the incremental cache of GCC 15");
+
+    kbuild_string_builder_clear(builder);
+    kbuild_append_lto_flags(builder, old_gcc, "build/lto-cache", 4);
+    char *old_gcc_flags = kbuild_string_builder_build(builder);
+    KTEST_ASSERT_EQ_STR(old_gcc_flags, "-flto=4", "Should only set the threads before GCC 15");
+
+    kbuild_string_builder_clear(builder);
+    kbuild_append_lto_flags(builder, clang, "build/lto-cache", 4);
+    char *clang_flags = kbuild_string_builder_build(builder);
+    KTEST_ASSERT((strstr(clang_flags, "jobs=4") != NULL), "Should set the ThinLTO threads");
+    KTEST_ASSERT((strstr(clang_flags, "cache-dir=build/lto-cache") != NULL), "Should set the ThinLTO cache");
+    KTEST_ASSERT((strstr(clang_flags, "cache_size_bytes=") != NULL), "Should bound the ThinLTO cache");
+
+    kbuild_set_lto(1);
+    kbuild_config_set_cc(kbuild_config("clang"), clang);
+    kbuild_config_set_cc(kbuild_config("gcc"), gcc);
+    const char *thin_flags = kbuild_resolve_flags("clang/a.c")->cflags;
+    const char *auto_flags = kbuild_resolve_flags("gcc/a.c")->cflags;
+    KTEST_ASSERT_EQ_STR(thin_flags + strlen(thin_flags) - strlen("-flto=thin"), "-flto=thin", "Should compile with ThinLTO for clang");
+    KTEST_ASSERT_EQ_STR(auto_flags + strlen(auto_flags) - strlen("-flto=auto"), "-flto=auto", "Should compile with -flto=auto for GCC");
+    kbuild_set_lto(0);
+    kbuild_set_linker(NULL);
+
+    free(gcc_flags);
+    free(old_gcc_flags);
+    free(clang_flags);
+    kbuild_free_string_builder(builder);
+    remove_test_dir(tools_path);
+    free(gcc);
+    free(old_gcc);
+    free(clang);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_ordered_fail_fast() {
+    char *src_path = create_test_dir(0);
+    KTEST_ASSERT((src_path != NULL), "Should create a temporary source directory");
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(src_path, "a.c", "int a(\n");
+    write_test_file(src_path, "b.c", "int b(\n");
+    write_test_file(build_path, "c.c", "int c(\n");
+    char *source_path = test_file_path(build_path, "c.c");
+    char *object_path = test_file_path(build_path, "c.o");
+
+    KTEST_ASSERT_EQ(kbuild_scheduler_init(), KBUILD_OK, "Should start the scheduler");
+    int max_jobs = kbuild_scheduler.max_jobs;
+    kbuild_set_jobs(1);
+    kbuild_set_ordered_output(1);
+
+    // The second compile is refused once the first one fails
+    int saved_stderr = silence_stderr();
+    KBUILD_DYNARR(kbuild_str_t) *objects = kbuild_compile_files_in_dir(src_path, build_path);
+    KbuildError error = kbuild_compile(source_path, object_path);
+    restore_stderr(saved_stderr);
+
+    KTEST_ASSERT((objects == NULL), "Should fail the first build");
+    KTEST_ASSERT_EQ(error, KBUILD_ERROR_COMPILING, "Should still report the failure of the next build");
+    KTEST_ASSERT_EQ(kbuild_scheduler.next_flush, kbuild_scheduler.next_sequence, "Should flush every job it started");
+
+    kbuild_set_ordered_output(0);
+    kbuild_set_jobs(max_jobs);
+    remove_test_dir(build_path);
+    remove_test_dir(src_path);
+    free(object_path);
+    free(source_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_resolve_linker() {
+    char *tools_path = create_test_dir(0);
+    KTEST_ASSERT((tools_path != NULL), "Should create a temporary directory");
+
+    // Like a GCC older than 12.1, which has no -fuse-ld=mold
+    write_test_file(tools_path, "old-gcc", "#!/bin/sh\ncase \"$1\" in\n-fuse-ld=gold|-fuse-ld=bfd) exit 0 ;;\nesac\nexit 1\n");
+    write_test_file(tools_path, "bare-gcc", "#!/bin/sh\nexit 1\n");
+    char *old_gcc = test_file_path(tools_path, "old-gcc");
+    char *bare_gcc = test_file_path(tools_path, "bare-gcc");
+    chmod(old_gcc, 0755);
+    chmod(bare_gcc, 0755);
+
+    kbuild_set_linker(NULL);
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_linker(old_gcc), "gold", "Should skip the linkers the driver rejects");
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_linker(bare_gcc), "gold", "Should only probe the driver once");
+
+    kbuild_set_linker(NULL);
+    KTEST_ASSERT_EQ_STR(kbuild_resolve_linker(bare_gcc), "", "Should keep the default linker when nothing else is accepted");
+
+    KbuildStringBuilder *builder = kbuild_create_string_builder();
+    kbuild_set_linker("gold");
+    kbuild_append_linker_flags(builder, bare_gcc, 4);
+    char *flags = kbuild_string_builder_build(builder);
+    KTEST_ASSERT_EQ_STR(flags, "-fuse-ld=gold -Wl,--threads,--thread-count=4", "Should give gold its thread count");
+
+    kbuild_set_linker(NULL);
+    free(flags);
+    kbuild_free_string_builder(builder);
+    remove_test_dir(tools_path);
+    free(old_gcc);
+    free(bare_gcc);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_cancel_exiting_job() {
+    char *src_path = create_test_dir(0);
+    KTEST_ASSERT((src_path != NULL), "Should create a temporary source directory");
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(src_path, "slow.c", "int slow(void) { return 0; }\n");
+    write_test_file(src_path, "broken.c", "int broken(void) { return 0; }\n");
+    char *slow_path = test_file_path(src_path, "slow.c");
+    char *broken_path = test_file_path(src_path, "broken.c");
+
+    // Closes its output right away, so it is only waited on through its pid
+    kbuild_config_set_cc(kbuild_config(slow_path), "sh -c 'exec >&- 2>&-; sleep 5' sh");
+    kbuild_config_set_cc(kbuild_config(broken_path), "sh -c 'sleep 0.2; exit 1' sh");
+
+    KTEST_ASSERT_EQ(kbuild_scheduler_init(), KBUILD_OK, "Should start the scheduler");
+    int max_jobs = kbuild_scheduler.max_jobs;
+    kbuild_set_jobs(2);
+
+    struct timespec started;
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int saved_stderr = silence_stderr();
+    KBUILD_DYNARR(kbuild_str_t) *objects = kbuild_compile_files_in_dir(src_path, build_path);
+    restore_stderr(saved_stderr);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    KTEST_ASSERT((objects == NULL), "Should fail the build");
+    KTEST_ASSERT((seconds < 2), "Should kill the job that closed its output");
+
+    kbuild_set_jobs(max_jobs);
+    remove_test_dir(build_path);
+    remove_test_dir(src_path);
+    free(broken_path);
+    free(slow_path);
+    kbuild_config_reset();
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_pipeline_languages() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "unit.cpp", "namespace unit { int value() { return 42; } }\n");
+    write_test_file(build_path, "unit.S", "#define VALUE 42\n.globl value\nvalue:\n    .long VALUE\n");
+    char *cxx_path = test_file_path(build_path, "unit.cpp");
+    char *cxx_object_path = test_file_path(build_path, "unit-cpp.o");
+    char *asm_path = test_file_path(build_path, "unit.S");
+    char *asm_object_path = test_file_path(build_path, "unit-asm.o");
+
+    kbuild_set_preprocess_jobs(2);
+    int saved_stderr = silence_stderr();
+    KbuildError cxx_error = kbuild_compile(cxx_path, cxx_object_path);
+    KbuildError asm_error = kbuild_compile(asm_path, asm_object_path);
+    restore_stderr(saved_stderr);
+    kbuild_set_preprocess_jobs(0);
+
+    KTEST_ASSERT_EQ(cxx_error, KBUILD_OK, "Should compile preprocessed C++ as C++");
+    KTEST_ASSERT_EQ(asm_error, KBUILD_OK, "Should compile other languages in one go");
+
+    remove_test_dir(build_path);
+    free(asm_object_path);
+    free(asm_path);
+    free(cxx_object_path);
+    free(cxx_path);
+
+    return KTEST_RESULT_OK;
+}
+
+KtestResult test_prepared_link() {
+    char *build_path = create_test_dir(0);
+    KTEST_ASSERT((build_path != NULL), "Should create a temporary build directory");
+
+    write_test_file(build_path, "main part.c", "int part(void);\nint main(void) { return part(); }\n");
+    write_test_file(build_path, "other part.c", "int part(void) { return 0; }\n");
+
+    KBUILD_DYNARR(kbuild_str_t) *object_files = KBUILD_CREATE_DYNARR(kbuild_str_t);
+    const char *names[2] = { "main part", "other part" };
+    for (int i = 0; i < 2; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s.c", names[i]);
+        char *source_path = test_file_path(build_path, name);
+        snprintf(name, sizeof(name), "%s.o", names[i]);
+        char *object_path = test_file_path(build_path, name);
+
+        KTEST_ASSERT_EQ(kbuild_compile(source_path, object_path), KBUILD_OK, "Should compile the object");
+        KBUILD_DYNARR_PUSH_BACK(object_files, object_path);
+        free(source_path);
+    }
+
+    // Each object is its own argument, blanks and all
+    char *output_path = test_file_path(build_path, "linked program");
+    int saved_stderr = silence_stderr();
+    KbuildError error = kbuild_link_files(object_files, output_path);
+    restore_stderr(saved_stderr);
+    KTEST_ASSERT_EQ(error, KBUILD_OK, "Should link without a shell");
+    KTEST_ASSERT((access(output_path, X_OK) == 0), "Should write the program");
+
+    remove_test_dir(build_path);
+    free(output_path);
+    kbuild_free_strs(object_files);
+
+    return KTEST_RESULT_OK;
+}
+
 int main() {
     KTEST(test_foreach_file);
     KTEST(test_string_builder);
@@ -342,6 +1515,35 @@ int main() {
     KTEST(test_join_paths);
     KTEST(test_join);
     KTEST(test_dyn_array);
+    KTEST(test_string_builder_json);
+    KTEST(test_compile_db);
+    KTEST(test_config_flags);
+    KTEST(test_parse_depfile);
+    KTEST(test_compile_log);
+    KTEST(test_compile_error);
+    KTEST(test_sweep_tmp_files);
+    KTEST(test_mkdir_cache);
+    KTEST(test_hashmap);
+    KTEST(test_intern_table);
+    KTEST(test_find_program);
+    KTEST(test_prune_dir);
+    KTEST(test_pending_compile_order);
+    KTEST(test_job_stats);
+    KTEST(test_fanout_report);
+    KTEST(test_hermetic_compile);
+    KTEST(test_sha256);
+    KTEST(test_local_executor);
+    KTEST(test_preprocess_pipeline);
+    KTEST(test_split_command);
+    KTEST(test_prepared_command);
+    KTEST(test_late_exit);
+    KTEST(test_interrupt);
+    KTEST(test_lto_flags);
+    KTEST(test_ordered_fail_fast);
+    KTEST(test_resolve_linker);
+    KTEST(test_cancel_exiting_job);
+    KTEST(test_pipeline_languages);
+    KTEST(test_prepared_link);
 
     return 0;
 }